@@ -41,6 +41,10 @@ namespace mmixal {
         private static readonly string[] SUBST_OPS =
             new string[] { OPC_SET, OPC_LDA };
 
+        // X of these is a byte count or hint rather than a register
+        private static readonly MmixOpcode[] CONSTANT_X_OPS =
+            new MmixOpcode[] { MmixOpcode.PRELD, MmixOpcode.PREGO, MmixOpcode.SYNCD, MmixOpcode.PREST, MmixOpcode.SYNCID };
+
         private static readonly string[] MMIX_PSEUDO_OPS =
             new string[] { OPC_IS, OPC_GREG, OPC_LOC, OPC_BYTE, OPC_WYDE, OPC_TETRA, OPC_OCTA };
 
@@ -127,6 +131,7 @@ namespace mmixal {
             bindOldSegmentTopSymbol();
             execDeferredRenderActions();
             makeGregSection();
+            makeMainSection();
         }
 
         private void makePredefinedSymbols() {
@@ -306,6 +311,22 @@ namespace mmixal {
             alignSection();
         }
 
+        // Laid out as an empty section at Main, so that older loaders skip it
+        private void makeMainSection() {
+            ExpressionValue main;
+            if (!_symbolBindings.TryGetValue("Main", out main))
+                return;
+            byte[] binSegName = Encoding.ASCII.GetBytes(".main");
+            _output.Write(binSegName, 0, binSegName.Length);
+            for (int i = binSegName.Length; (i % 8) != 0; i++)
+                _output.WriteByte(0);
+            byte[] buff = new byte[8];
+            doRenderSingleOcta(ExpressionBuilder.makePointer(main.asMmixOcta()), _symbolBindings, 0, 0, buff);
+            _output.Write(buff, 0, buff.Length);
+            _output.Write(buff, 0, buff.Length);
+            alignSection();
+        }
+
         private void renderOpcode(RawAsmLine asmLine) {
             byte[] outputSeq = new byte[4];
             if (!SUBST_OPS.Contains(asmLine.Opcode)) {
@@ -382,6 +403,8 @@ namespace mmixal {
                         ExpressionValue arg3;
                         try {
                             arg1 = expr1.eval(_symbolBindings);
+                            if (arg1.IsNumeric && CONSTANT_X_OPS.Contains(opcode))
+                                arg1 = ExpressionValue.makeRegister(arg1.asMmixOcta());
                             if (expr3 != null) {
                                 arg2 = expr2.eval(_symbolBindings);
                                 arg3 = expr3.eval(_symbolBindings);
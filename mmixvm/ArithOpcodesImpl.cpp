@@ -74,6 +74,18 @@ namespace {
 		vctx.assignSpRegister(MmixLlvm::rA, ra);
 		builder.CreateBr(vctx.getOCExit());
 	}
+
+	// LLVM leaves shifts by 64 or more undefined; MMIX shifts every bit out,
+	// as the interpreter does
+	Value* emitShl(IRBuilder<>& builder, Value* y, Value* z) {
+		return builder.CreateSelect(builder.CreateICmpULT(z, builder.getInt64(64)),
+			builder.CreateShl(y, z), builder.getInt64(0));
+	}
+
+	Value* emitLShr(IRBuilder<>& builder, Value* y, Value* z) {
+		return builder.CreateSelect(builder.CreateICmpULT(z, builder.getInt64(64)),
+			builder.CreateLShr(y, z), builder.getInt64(0));
+	}
 };
 
 void MmixLlvm::Private::emitAdd(VerticeContext& vctx, IRBuilder<>& builder, MXByte xarg, MXByte yarg, MXByte zarg, bool immediate)
@@ -220,49 +232,77 @@ void MmixLlvm::Private::emitSubu(VerticeContext& vctx, IRBuilder<>& builder, MXB
 	builder.CreateBr(vctx.getOCExit());
 }
 
+namespace {
+	// Full 128 bit product of two octabytes. The VM only builds for Win32,
+	// where an i128 multiply lowers to a __multi3 call the JIT cannot
+	// resolve, so it is put together from tetrabyte halves.
+	void emitMul128(VerticeContext& vctx, IRBuilder<>& builder, Value* y, Value* z, Value*& hi, Value*& lo) {
+		Value* mask = builder.getInt64(UINT32_MAX);
+		Value* y0 = builder.CreateAnd(y, mask);
+		Value* y1 = builder.CreateLShr(y, 32);
+		Value* z0 = builder.CreateAnd(z, mask);
+		Value* z1 = builder.CreateLShr(z, 32);
+		Value* p00 = builder.CreateMul(y0, z0);
+		Value* p01 = builder.CreateMul(y0, z1);
+		Value* p10 = builder.CreateMul(y1, z0);
+		Value* p11 = builder.CreateMul(y1, z1);
+		Value* mid = builder.CreateAdd(builder.CreateLShr(p00, 32),
+			builder.CreateAdd(builder.CreateAnd(p01, mask), builder.CreateAnd(p10, mask)));
+		lo = builder.CreateOr(builder.CreateShl(mid, 32), builder.CreateAnd(p00, mask));
+		hi = builder.CreateAdd(builder.CreateAdd(p11, builder.CreateLShr(p01, 32)),
+			builder.CreateAdd(builder.CreateLShr(p10, 32), builder.CreateLShr(mid, 32)));
+	}
+};
+
 void MmixLlvm::Private::emitMulu(VerticeContext& vctx, IRBuilder<>& builder,
 	MXByte xarg, MXByte yarg, MXByte zarg, bool immediate)
 {
-	LLVMContext& ctx = vctx.getLctx();
-	Value* loProd = builder.CreateAlloca(Type::getInt64Ty(ctx));
-	Value* hiProd = builder.CreateAlloca(Type::getInt64Ty(ctx));
-	Value* callParams[] = {
-		vctx.getRegister( yarg),
-		immediate ? builder.getInt64(zarg) : vctx.getRegister(zarg),
-		hiProd,
-		loProd
-	};
-	Twine label = (immediate ? Twine("mulu") : Twine("mului")) + Twine(yarg) + Twine(zarg);
-	builder.CreateCall(vctx.getModuleFunction("MuluImpl"), ArrayRef<Value*>(callParams, callParams + 4));
-	Value* xval0 = builder.CreateLoad(loProd, false, label);
-	Value* rh = builder.CreateLoad(hiProd);
-	assignRegister(vctx, builder, xarg, xval0);
-	vctx.assignSpRegister(MmixLlvm::rH, rh);
+	Value* yreg = vctx.getRegister(yarg);
+	Value* zreg = immediate ? builder.getInt64(zarg) : vctx.getRegister(zarg);
+	Value* hiProd;
+	Value* loProd;
+	emitMul128(vctx, builder, yreg, zreg, hiProd, loProd);
+	assignRegister(vctx, builder, xarg, loProd);
+	vctx.assignSpRegister(MmixLlvm::rH, hiProd);
 	builder.CreateBr(vctx.getOCExit());
 }
 
+// rD is almost always zero, which leaves a plain octabyte division. Only a
+// nonzero rD below the divisor needs the 128 by 64 bit DivuImpl: i128
+// udiv lowers to a __udivti3 call the JIT cannot resolve on Windows.
 void MmixLlvm::Private::emitDivu(VerticeContext& vctx, IRBuilder<>& builder,
 	MXByte xarg, MXByte yarg, MXByte zarg, bool immediate)
 {
 	LLVMContext& ctx = vctx.getLctx();
 	BasicBlock *simpleCase = vctx.makeBlock("simple_case");
+	BasicBlock *divideCase = vctx.makeBlock("divide_case");
+	BasicBlock *shortCase = vctx.makeBlock("short_case");
 	BasicBlock *fullCase = vctx.makeBlock("full_case");
 	BasicBlock *epilogue = vctx.makeBlock("epilogue");
 	Value* yreg = vctx.getRegister( yarg);
 	Value* rd = vctx.getSpRegister(MmixLlvm::rD);
 	Value* zreg = immediate ? builder.getInt64(zarg) : vctx.getRegister(zarg);
 	Value* rdGreaterThanZreg = builder.CreateICmpUGE(rd, zreg);
-	builder.CreateCondBr(rdGreaterThanZreg, simpleCase, fullCase);
+	builder.CreateCondBr(rdGreaterThanZreg, simpleCase, divideCase);
 	builder.SetInsertPoint(simpleCase);
 	builder.CreateBr(epilogue);
+	builder.SetInsertPoint(divideCase);
+	builder.CreateCondBr(builder.CreateICmpEQ(rd, builder.getInt64(0)), shortCase, fullCase);
+	builder.SetInsertPoint(shortCase);
+	// Named twice each, so kept as strings: a Twine local would outlive the
+	// temporaries it refers to
+	std::string suffix = (Twine(yarg) + "_" + Twine(zarg)).str();
+	std::string labelq = (immediate ? "divui_q" : "divu_q") + suffix;
+	std::string labelr = (immediate ? "divui_r" : "divu_r") + suffix;
+	Value* shortQuotient = builder.CreateUDiv(yreg, zreg, labelq);
+	Value* shortRemainder = builder.CreateURem(yreg, zreg, labelr);
+	builder.CreateBr(epilogue);
 	builder.SetInsertPoint(fullCase);
 	Value* quotPtr = builder.CreateAlloca(Type::getInt64Ty(ctx));
 	Value* remPtr = builder.CreateAlloca(Type::getInt64Ty(ctx));
 	Value* callParams[] = {
 		rd, yreg, zreg, quotPtr, remPtr
 	};
-	Twine labelq = (immediate ? Twine("divu_q") : Twine("divui_q")) + Twine(yarg) + Twine(zarg);
-	Twine labelr = (immediate ? Twine("divu_r") : Twine("divui_r")) + Twine(yarg) + Twine(zarg);
 	builder.CreateCall(vctx.getModuleFunction("DivuImpl"), ArrayRef<Value*>(callParams, callParams + 5));
 	Value* quotient = builder.CreateLoad(quotPtr, labelq);
 	Value* remainder = builder.CreateLoad(remPtr, labelr);
@@ -270,9 +310,11 @@ void MmixLlvm::Private::emitDivu(VerticeContext& vctx, IRBuilder<>& builder,
 	builder.SetInsertPoint(epilogue);
 	PHINode* quotResult = builder.CreatePHI(Type::getInt64Ty(ctx), 0);
 	quotResult->addIncoming(quotient, fullCase);
+	quotResult->addIncoming(shortQuotient, shortCase);
 	quotResult->addIncoming(rd, simpleCase);
 	PHINode* remResult = builder.CreatePHI(Type::getInt64Ty(ctx), 0);
 	remResult->addIncoming(remainder, fullCase);
+	remResult->addIncoming(shortRemainder, shortCase);
 	remResult->addIncoming(yreg, simpleCase);
 	assignRegister(vctx, builder, xarg, quotResult);
 	vctx.assignSpRegister(MmixLlvm::rR, remResult);
@@ -299,28 +341,15 @@ void MmixLlvm::Private::emitNegu(VerticeContext& vctx, IRBuilder<>& builder,
 	builder.CreateBr(vctx.getOCExit());
 }
 
+// Shifting by 63 already fills every bit with the sign.
 void MmixLlvm::Private::emitSr(VerticeContext& vctx, IRBuilder<>& builder,
 	MXByte xarg, MXByte yarg, MXByte zarg, bool immediate)
 {
-	LLVMContext& ctx = vctx.getLctx();
-	BasicBlock *yPositiveBlock = vctx.makeBlock("y_positive");
-	BasicBlock *yNegativeBlock = vctx.makeBlock("y_negative");
-	BasicBlock *yDefBlock = vctx.makeBlock("y_def");
-	BasicBlock *epilogue = vctx.makeBlock("epilogue");
 	Value* yarg0 = vctx.getRegister(yarg);
 	Value* zarg0 =  immediate ? builder.getInt64(zarg) : vctx.getRegister(zarg);
-	Value* yIsPositive = builder.CreateICmpSGE(yarg0, builder.getInt64(0));
-	builder.CreateCondBr(yIsPositive, yPositiveBlock, yNegativeBlock);
-	builder.SetInsertPoint(yPositiveBlock);
-	builder.CreateBr(yDefBlock);
-	builder.SetInsertPoint(yNegativeBlock);
-	Value* mask0 = builder.CreateShl(builder.getInt64(~0ui64), builder.CreateSub(builder.getInt64(64), zarg0));
-	builder.CreateBr(yDefBlock);
-	builder.SetInsertPoint(yDefBlock);
-	PHINode* mask = builder.CreatePHI(Type::getInt64Ty(ctx), 0);
-	mask->addIncoming(builder.getInt64(0), yPositiveBlock);
-	mask->addIncoming(mask0, yNegativeBlock);
-	Value* result = builder.CreateOr(builder.CreateLShr(yarg0, zarg0), mask);
+	Value* shift = builder.CreateSelect(builder.CreateICmpULT(zarg0, builder.getInt64(64)),
+		zarg0, builder.getInt64(63));
+	Value* result = builder.CreateAShr(yarg0, shift);
 	assignRegister(vctx, builder, xarg, result);
 	builder.CreateBr(vctx.getOCExit());
 }
@@ -330,7 +359,7 @@ void MmixLlvm::Private::emitSru(VerticeContext& vctx, IRBuilder<>& builder,
 {
 	Value* yarg0 = vctx.getRegister( yarg);
 	Value* zarg0 =  immediate ? builder.getInt64(zarg) : vctx.getRegister(zarg);
-	Value* result = builder.CreateLShr(yarg0, zarg0);
+	Value* result = emitLShr(builder, yarg0, zarg0);
 	assignRegister(vctx, builder, xarg, result);
 	builder.CreateBr(vctx.getOCExit());
 }
@@ -383,7 +412,7 @@ void MmixLlvm::Private::emitSl(VerticeContext& vctx, IRBuilder<>& builder,
 	Value* overflow = builder.CreateICmpNE(builder.CreateAnd(y0, mask), builder.getInt64(0));
 	builder.CreateCondBr(overflow, overflowBlock, successBlock);
 	builder.SetInsertPoint(successBlock);
-	Value* result = builder.CreateShl(yarg0, zarg0);
+	Value* result = emitShl(builder, yarg0, zarg0);
 	builder.CreateBr(epilogue);
 	builder.SetInsertPoint(overflowBlock);
 	Value* initXRegVal = vctx.getRegister(xarg);
@@ -414,7 +443,7 @@ void MmixLlvm::Private::emitSlu(VerticeContext& vctx, IRBuilder<>& builder,
 {
 	Value* yarg0 = vctx.getRegister(yarg);
 	Value* zarg0 =  immediate ? builder.getInt64(zarg) : vctx.getRegister(zarg);
-	Value* result = builder.CreateShl(yarg0, zarg0);
+	Value* result = emitShl(builder, yarg0, zarg0);
 	assignRegister(vctx, builder, xarg, result);
 	builder.CreateBr(vctx.getOCExit());
 }
@@ -23,6 +23,7 @@ using namespace MmixLlvm::Private;
 //using MmixLlvm::Private::RegisterRecord;
 //using MmixLlvm::Private::RegistersMap;
 using MmixLlvm::MXByte;
+using MmixLlvm::MXOcta;
 
 namespace {
 	template<typename BitOp> 
@@ -199,30 +200,71 @@ loop0_cont:
 	newI = i + 1;
 	if newI < 8 br loop0 else br epilogue;
 epilogue: ret retVal*/
+namespace {
+	// MMIX byte reversal, z byte i selecting y byte 7 - i
+	const MXOcta BYTE_REVERSAL = 0x0102040810204080ULL;
+
+	// MOR or MXOR by a Z known at JIT time. Result byte i takes y byte j for
+	// every bit j of z byte i; pairs at the same distance i - j share a shift
+	// and a mask, leaving at most 15 masked copies of y to combine.
+	Value* emitConstMatrixOp(VerticeContext& vctx, IRBuilder<>& builder, Value* y, MXOcta z, bool exclusive) {
+		if (z == BYTE_REVERSAL) {
+			Type* intrinsicArgs[] = { builder.getInt64Ty() };
+			Function* bswap = vctx.getIntrinsic(llvm::Intrinsic::bswap, ArrayRef<Type*>(intrinsicArgs, intrinsicArgs + 1));
+			return builder.CreateCall(bswap, y);
+		}
+		MXOcta masks[15] = { 0 };
+		for (int i = 0; i < 8; i++) {
+			MXByte b = (MXByte)(z >> (i << 3));
+			for (int j = 0; j < 8; j++) {
+				if ((b & (1 << j)) != 0)
+					masks[i - j + 7] |= (MXOcta)0xFF << (i << 3);
+			}
+		}
+		Value* result = builder.getInt64(0);
+		for (int d = -7; d <= 7; d++) {
+			if (masks[d + 7] == 0)
+				continue;
+			Value* shifted = d >= 0 ? builder.CreateShl(y, builder.getInt64(d << 3))
+				: builder.CreateLShr(y, builder.getInt64(-d << 3));
+			Value* term = builder.CreateAnd(shifted, builder.getInt64(masks[d + 7]));
+			result = exclusive ? builder.CreateXor(result, term) : builder.CreateOr(result, term);
+		}
+		return result;
+	}
+
+	void emitMatrixOp(VerticeContext& vctx, IRBuilder<>& builder,
+		MXByte xarg, MXByte yarg, MXByte zarg, bool immediate, bool exclusive)
+	{
+		Value* yreg = vctx.getRegister(yarg);
+		Value* zreg = immediate ? builder.getInt64(zarg) : vctx.getRegister(zarg);
+		Value* result;
+		if (llvm::ConstantInt* zconst = llvm::dyn_cast<llvm::ConstantInt>(zreg)) {
+			result = emitConstMatrixOp(vctx, builder, yreg, zconst->getZExtValue(), exclusive);
+		} else {
+			Value* callParams[] = { yreg, zreg };
+			result = builder.CreateCall(vctx.getModuleFunction(exclusive ? "MxorImpl" : "MorImpl"),
+				ArrayRef<Value*>(callParams, callParams + 2));
+		}
+		assignRegister(vctx, builder, xarg, result);
+		builder.CreateBr(vctx.getOCExit());
+	}
+};
+
+// An immediate or otherwise constant Z is expanded inline, anything else
+// calls MorImpl or MxorImpl of runtime/MmixRuntime.cpp, inlined from the
+// bitcode once optimized and otherwise mapped by MmixHwImpl::postInit to
+// its SSSE3 kernel where the host has one.
 void MmixLlvm::Private::emitMor(VerticeContext& vctx, IRBuilder<>& builder,
 	MXByte xarg, MXByte yarg, MXByte zarg, bool immediate)
 {
-	Value* callParams[] = {
-		vctx.getRegister( yarg),
-		immediate ? builder.getInt64(zarg) : vctx.getRegister(zarg),
-	};
-	Twine label = (immediate ? Twine("mor") : Twine("mori")) + Twine(yarg) + Twine(zarg);
-	Value* result = builder.CreateCall(vctx.getModuleFunction("MorImpl"), ArrayRef<Value*>(callParams, callParams + 2));
-	assignRegister(vctx, builder, xarg, result);
-	builder.CreateBr(vctx.getOCExit());
+	emitMatrixOp(vctx, builder, xarg, yarg, zarg, immediate, false);
 }
 
 void MmixLlvm::Private::emitMxor(VerticeContext& vctx, IRBuilder<>& builder,
 	MXByte xarg, MXByte yarg, MXByte zarg, bool immediate)
 {
-	Value* callParams[] = {
-		vctx.getRegister( yarg),
-		immediate ? builder.getInt64(zarg) : vctx.getRegister(zarg),
-	};
-	Twine label = (immediate ? Twine("mxor") : Twine("mxori")) + Twine(yarg) + Twine(zarg);
-	Value* result = builder.CreateCall(vctx.getModuleFunction("MxorImpl"), ArrayRef<Value*>(callParams, callParams + 2));
-	assignRegister(vctx, builder, xarg, result);
-	builder.CreateBr(vctx.getOCExit());
+	emitMatrixOp(vctx, builder, xarg, yarg, zarg, immediate, true);
 }
 
 /*
@@ -8,14 +8,17 @@ using llvm::LLVMContext;
 using llvm::Module;
 using llvm::Type;
 using llvm::PointerType;
+using llvm::ArrayType;
 using llvm::Value;
 using llvm::PHINode;
 using llvm::Argument;
 using llvm::Function;
+using llvm::Constant;
 using llvm::BasicBlock;
 using llvm::IRBuilder;
 using llvm::ArrayRef;
 using llvm::SwitchInst;
+using llvm::CallInst;
 using llvm::Twine;
 using llvm::cast;
 
@@ -28,16 +31,48 @@ using MmixLlvm::MXOcta;
 namespace {
 	const MXTetra REGION_BIT_OFFSET = 61;
 	const MXOcta TWO_ENABLED_BITS = 3i64;
-	const MXOcta ADDR_MASK = ~(TWO_ENABLED_BITS << REGION_BIT_OFFSET);
+
+	// Index into Memory: the segment base from AddressTranslateTable plus the
+	// offset masked to the segment's slot, whose tail is guard, so a stray
+	// pointer faults or wraps instead of reaching anything else.
+	Value* emitGuestOffset(VerticeContext& vctx, IRBuilder<>& builder, Value* theA) {
+		Value* glob = vctx.getModuleVar("AddressTranslateTable");
+		Value* ix[2];
+		ix[0] = builder.getInt32(0);
+		ix[1] = builder.CreateShl(
+			builder.CreateIntCast(
+				builder.CreateAnd(
+					builder.CreateLShr(theA, REGION_BIT_OFFSET),
+					builder.getInt64(TWO_ENABLED_BITS)),
+				Type::getInt32Ty(vctx.getLctx()), false),
+			builder.getInt32(1));
+		Value* attBase = builder.CreateLoad(builder.CreateGEP(glob, ArrayRef<Value*>(ix, ix + 2)));
+		return builder.CreateAdd(builder.CreateAnd(theA, builder.getInt64(vctx.getCfg().SegmentOffsetMask)), attBase);
+	}
+
+	// Where an aligned unit of ty lives: in host byte order the octabyte is
+	// reversed as a whole, so its narrower units sit at mirrored offsets
+	Value* emitHostAddr(VerticeContext& vctx, IRBuilder<>& builder, Value* theA, Type* ty) {
+		unsigned bytes = ty->getPrimitiveSizeInBits() / 8;
+		if (!vctx.getCfg().NativeByteOrder || bytes == 8)
+			return theA;
+		return builder.CreateXor(theA, builder.getInt64(8 - bytes));
+	}
 };
 
+// The adjustments below vanish in host byte order: memory holds the values
+// as the host reads them.
 Value* MmixLlvm::Private::emitAdjust64Endianness(VerticeContext& vctx, IRBuilder<>& builder, Value* val) {
+	if (vctx.getCfg().NativeByteOrder)
+		return val;
 	Function* f = vctx.getModuleFunction("Adjust64EndiannessImpl");
 	Value* args[] = { val };
 	return builder.CreateCall(f, ArrayRef<Value*>(args, args + 1));
 }
 
 Value* MmixLlvm::Private::emitAdjust32Endianness(VerticeContext& vctx, IRBuilder<>& builder, Value* val) {
+	if (vctx.getCfg().NativeByteOrder)
+		return val;
 	Value* b0 = builder.CreateLShr(val, builder.getInt32(24));
 	Value* b1 = builder.CreateAnd(builder.CreateLShr(val, builder.getInt32(16)), builder.getInt32(0xFF));
 	Value* b2 = builder.CreateAnd(builder.CreateLShr(val, builder.getInt32(8)), builder.getInt32(0xFF));
@@ -50,6 +85,8 @@ Value* MmixLlvm::Private::emitAdjust32Endianness(VerticeContext& vctx, IRBuilder
 }
 
 Value* MmixLlvm::Private::emitAdjust16Endianness(VerticeContext& vctx, IRBuilder<>& builder, Value* val) {
+	if (vctx.getCfg().NativeByteOrder)
+		return val;
 	Value* b0 = builder.CreateLShr(val, builder.getInt16(8));
 	Value* b1 = builder.CreateAnd(val, builder.getInt16(0xFF));
 	Value* q0 = builder.CreateShl(b1, builder.getInt16(8));
@@ -65,32 +102,194 @@ Value* MmixLlvm::Private::emitQueryArithFlag(VerticeContext& vctx, IRBuilder<>&
 namespace {
 	void saveRegisters(VerticeContext& vctx, IRBuilder<>& builder)
 	{
-		LLVMContext& ctx = vctx.getLctx();
 		std::vector<MXByte> dirtyRegs(vctx.getDirtyRegisters());
-		for (auto itr = dirtyRegs.begin(); itr != dirtyRegs.end(); ++itr) {
-			Value* regGlob = builder.CreateSelect(
-				builder.CreateICmpULT(builder.getInt64(*itr), 
-					vctx.getSpRegister(MmixLlvm::rG)),
-						vctx.getModuleVar("RegisterStackTop"),
-						vctx.getModuleVar("RegisterStackBase"));
-			builder.CreateStore(
-				vctx.getRegister(*itr),
-					builder.CreateGEP(
-						builder.CreateLoad(regGlob, false),
-						builder.getInt32(*itr)));
-		}
-		Value* specialRegisters = vctx.getModuleVar("SpecialRegisters");
+		for (auto itr = dirtyRegs.begin(); itr != dirtyRegs.end(); ++itr)
+			emitSaveRegister(vctx, builder, *itr);
 		std::vector<MmixLlvm::SpecialReg> dirtySRegs(vctx.getDirtySpRegisters());
-		for (auto itr = dirtySRegs.begin(); itr != dirtySRegs.end(); ++itr) {
-			Value* ix[2];
-			ix[0] = builder.getInt32(0);
-			ix[1] = builder.getInt32(*itr);
-			builder.CreateStore(
-				vctx.getSpRegister(*itr),
-				builder.CreatePointerCast(
-					builder.CreateGEP(specialRegisters, ArrayRef<Value*>(ix, ix + 2)), Type::getInt64PtrTy(ctx)));
+		for (auto itr = dirtySRegs.begin(); itr != dirtySRegs.end(); ++itr)
+			emitSaveSpRegister(vctx, builder, *itr);
+	}
+
+	void pushRegs(VerticeContext& vctx, IRBuilder<>& builder, MXByte xarg)
+	{
+		LLVMContext& ctx = vctx.getLctx();
+		Value* rLVal = vctx.getSpRegister(MmixLlvm::rL);
+		Value* k = builder.getInt64(xarg);
+		saveRegisters(vctx, builder);
+		Function* pushRegStack = vctx.getModuleFunction("PushRegStack");
+		MXOcta returnXref = vctx.getXPtr() + 4;
+		Value* returnLink = vctx.getReturnLink(returnXref);
+		Value* callParams[] = {
+			builder.CreateLoad(vctx.getModuleVar("ThisRef")),
+			builder.CreateAdd(k, builder.getInt64(1)),
+			vctx.getSpRegister(MmixLlvm::rL),
+			builder.getInt64(returnXref),
+			returnLink ? returnLink : Constant::getNullValue(pushRegStack->getFunctionType()->getParamType(4))
+		};
+		builder.CreateCall(pushRegStack, ArrayRef<Value*>(callParams, callParams + 5));
+		Value* newRlVal = builder.CreateSelect(
+			builder.CreateICmpULT(k, rLVal),
+			builder.CreateSub(rLVal, builder.CreateAdd(k, builder.getInt64(1))),
+			builder.CreateAdd(k, builder.getInt64(1)));
+		Value* specialRegisters = vctx.getModuleVar("SpecialRegisters");
+		Value* ix[2];
+		ix[0] = builder.getInt32(0);
+		ix[1] = builder.getInt32((int)MmixLlvm::rL);
+		builder.CreateStore(
+			newRlVal,
+			builder.CreatePointerCast(
+				builder.CreateGEP(specialRegisters, ArrayRef<Value*>(ix, ix + 2)), Type::getInt64PtrTy(ctx)));
+	}
+
+	void emitBumpCounter(VerticeContext& vctx, IRBuilder<>& builder, const char* counterName)
+	{
+		if (!vctx.getCfg().EnableExitCounters)
+			return;
+		Value* counter = vctx.getModuleVar(counterName);
+		builder.CreateStore(
+			builder.CreateAdd(builder.CreateLoad(counter, false), builder.getInt64(1)),
+			counter);
+	}
+
+	void emitTailCallVertice(VerticeContext& vctx, IRBuilder<>& builder, Value* entry)
+	{
+		std::vector<Argument*> args(vctx.getVerticeArgs());
+		Value* callParams[] = { args[0], args[1] };
+		CallInst* call = builder.CreateCall(entry, ArrayRef<Value*>(callParams, callParams + 2));
+		call->setTailCall();
+		builder.CreateRetVoid();
+	}
+
+	Value* emitCacheSlotField(IRBuilder<>& builder, Value* cache, Value* slot, int field)
+	{
+		Value* ix[3];
+		ix[0] = builder.getInt32(0);
+		ix[1] = slot;
+		ix[2] = builder.getInt32(field);
+		return builder.CreateGEP(cache, ArrayRef<Value*>(ix, ix + 3));
+	}
+
+	uint64_t getCacheSize(Value* cache)
+	{
+		return cast<ArrayType>(cast<PointerType>(cache->getType())->getElementType())->getNumElements();
+	}
+
+	// Moves every inline cache slot one place down, dropping the least recently
+	// patched target, and stores the new target in front.
+	void emitPatchInlineCache(IRBuilder<>& builder, Value* inlineCache, Value* target, Value* entry)
+	{
+		for (uint64_t i = getCacheSize(inlineCache) - 1; i > 0; i--) {
+			for (int field = 0; field < 2; field++) {
+				builder.CreateStore(
+					builder.CreateLoad(emitCacheSlotField(builder, inlineCache, builder.getInt32(i - 1), field), false),
+					emitCacheSlotField(builder, inlineCache, builder.getInt32(i), field));
+			}
 		}
+		builder.CreateStore(target, emitCacheSlotField(builder, inlineCache, builder.getInt32(0), 0));
+		builder.CreateStore(entry, emitCacheSlotField(builder, inlineCache, builder.getInt32(0), 1));
 	}
+
+	// Probes the direct-mapped translation cache inline and enters the target
+	// on a hit; a miss returns to the dispatcher, which does the map lookup.
+	// A hit also patches the exit's inline cache, if it has one.
+	void leaveVerticeViaTranslationCache(VerticeContext& vctx, IRBuilder<>& builder,
+		Value* target, Value* inlineCache)
+	{
+		Value* cache = vctx.getModuleVar("TranslationCache");
+		BasicBlock *hit = vctx.makeBlock("tc_hit");
+		BasicBlock *miss = vctx.makeBlock("tc_miss");
+		Value* slot = builder.CreateIntCast(
+			builder.CreateAnd(builder.CreateLShr(target, 2), builder.getInt64(getCacheSize(cache) - 1)),
+				Type::getInt32Ty(vctx.getLctx()), false);
+		Value* xref = builder.CreateLoad(emitCacheSlotField(builder, cache, slot, 0), false);
+		Value* entry = builder.CreateLoad(emitCacheSlotField(builder, cache, slot, 1), false);
+		builder.CreateCondBr(builder.CreateICmpEQ(xref, target), hit, miss);
+		builder.SetInsertPoint(hit);
+		emitBumpCounter(vctx, builder, "TranslationCacheHits");
+		if (inlineCache)
+			emitPatchInlineCache(builder, inlineCache, target, entry);
+		emitTailCallVertice(vctx, builder, entry);
+		builder.SetInsertPoint(miss);
+		builder.CreateRetVoid();
+	}
+
+	void leaveVerticeViaStaticExit(VerticeContext& vctx, IRBuilder<>& builder, MXOcta target)
+	{
+		std::vector<Argument*> args(vctx.getVerticeArgs());
+		builder.CreateStore(builder.getInt64(vctx.getXPtr()), args[0]);
+		builder.CreateStore(builder.getInt64(target), args[1]);
+		Value* link = vctx.getEdgeLink(target);
+		if (link) {
+			BasicBlock *chained = vctx.makeBlock("chained");
+			BasicBlock *unchained = vctx.makeBlock("unchained");
+			Value* entry = builder.CreateLoad(link, false);
+			builder.CreateCondBr(builder.CreateIsNotNull(entry), chained, unchained);
+			builder.SetInsertPoint(chained);
+			emitBumpCounter(vctx, builder, "ChainedExits");
+			emitTailCallVertice(vctx, builder, entry);
+			builder.SetInsertPoint(unchained);
+		}
+		// Dynamic exits, traps and faults are not counted here
+		emitBumpCounter(vctx, builder, "UnchainedExits");
+		leaveVerticeViaTranslationCache(vctx, builder, builder.getInt64(target), 0);
+	}
+
+	void leaveVerticeViaDynamicExit(VerticeContext& vctx, IRBuilder<>& builder, Value* target,
+		Value* predictedEntry)
+	{
+		std::vector<Argument*> args(vctx.getVerticeArgs());
+		builder.CreateStore(builder.getInt64(vctx.getXPtr()), args[0]);
+		builder.CreateStore(target, args[1]);
+		if (predictedEntry) {
+			BasicBlock *predicted = vctx.makeBlock("predicted");
+			BasicBlock *mispredicted = vctx.makeBlock("mispredicted");
+			builder.CreateCondBr(builder.CreateIsNotNull(predictedEntry), predicted, mispredicted);
+			builder.SetInsertPoint(predicted);
+			emitTailCallVertice(vctx, builder, predictedEntry);
+			builder.SetInsertPoint(mispredicted);
+		}
+		Value* inlineCache = vctx.getInlineCache();
+		if (inlineCache) {
+			for (uint64_t i = 0; i < getCacheSize(inlineCache); i++) {
+				BasicBlock *hit = vctx.makeBlock("ic_hit");
+				BasicBlock *next = vctx.makeBlock("ic_next");
+				Value* xref = builder.CreateLoad(
+					emitCacheSlotField(builder, inlineCache, builder.getInt32(i), 0), false);
+				builder.CreateCondBr(builder.CreateICmpEQ(xref, target), hit, next);
+				builder.SetInsertPoint(hit);
+				emitBumpCounter(vctx, builder, "InlineCacheHits");
+				emitTailCallVertice(vctx, builder, builder.CreateLoad(
+					emitCacheSlotField(builder, inlineCache, builder.getInt32(i), 1), false));
+				builder.SetInsertPoint(next);
+			}
+			emitBumpCounter(vctx, builder, "InlineCacheMisses");
+		}
+		leaveVerticeViaTranslationCache(vctx, builder, target, inlineCache);
+	}
+}
+
+void MmixLlvm::Private::emitSaveRegister(VerticeContext& vctx, IRBuilder<>& builder, MXByte reg) {
+	Value* regGlob = builder.CreateSelect(
+		builder.CreateICmpULT(builder.getInt64(reg), 
+			vctx.getSpRegister(MmixLlvm::rG)),
+				vctx.getModuleVar("RegisterStackTop"),
+				vctx.getModuleVar("RegisterStackBase"));
+	builder.CreateStore(
+		vctx.getRegister(reg),
+			builder.CreateGEP(
+				builder.CreateLoad(regGlob, false),
+				builder.getInt32(reg)));
+}
+
+void MmixLlvm::Private::emitSaveSpRegister(VerticeContext& vctx, IRBuilder<>& builder, MmixLlvm::SpecialReg sreg) {
+	Value* ix[2];
+	ix[0] = builder.getInt32(0);
+	ix[1] = builder.getInt32(sreg);
+	builder.CreateStore(
+		vctx.getSpRegister(sreg),
+		builder.CreatePointerCast(
+			builder.CreateGEP(vctx.getModuleVar("SpecialRegisters"), ArrayRef<Value*>(ix, ix + 2)),
+				Type::getInt64PtrTy(vctx.getLctx())));
 }
 
 void MmixLlvm::Private::flushRegistersCache(VerticeContext& vctx, llvm::IRBuilder<>& builder) {
@@ -129,73 +328,39 @@ void MmixLlvm::Private::emitLeaveVerticeViaTrip(VerticeContext& vctx, llvm::IRBu
 
 void MmixLlvm::Private::emitLeaveVerticeViaJump(VerticeContext& vctx, IRBuilder<>& builder, MXOcta target) 
 {
+	saveRegisters(vctx, builder);
+	leaveVerticeViaStaticExit(vctx, builder, target);
+}
+
+// Leaves for the dispatcher, resuming at target, once the host asks the
+// guest to stop; otherwise carries on where builder was.
+void MmixLlvm::Private::emitPollPreempt(VerticeContext& vctx, IRBuilder<>& builder, MXOcta target)
+{
+	BasicBlock *stop = vctx.makeBlock("preempt");
+	BasicBlock *resume = vctx.makeBlock("resume");
+	Value* preempt = builder.CreateLoad(vctx.getModuleVar("Preempt"), true);
+	builder.CreateCondBr(builder.CreateIsNotNull(preempt), stop, resume);
+	builder.SetInsertPoint(stop);
 	saveRegisters(vctx, builder);
 	std::vector<Argument*> args(vctx.getVerticeArgs());
 	builder.CreateStore(builder.getInt64(vctx.getXPtr()), args[0]);
 	builder.CreateStore(builder.getInt64(target), args[1]);
 	builder.CreateRetVoid();
+	builder.SetInsertPoint(resume);
 }
 
 void MmixLlvm::Private::emitPushRegsAndLeaveVerticeViaJump(VerticeContext&vctx,
 	MXByte xarg, IRBuilder<>& builder, MXOcta target)
 {
-	LLVMContext& ctx = vctx.getLctx();
-	Value* rLVal = vctx.getSpRegister(MmixLlvm::rL);
-	Value* k = builder.getInt64(xarg);
-	saveRegisters(vctx, builder);
-	Value* callParams[] = {
-		builder.CreateLoad(vctx.getModuleVar("ThisRef")),
-		builder.CreateAdd(k, builder.getInt64(1)),
-		vctx.getSpRegister(MmixLlvm::rL)
-	};
-	builder.CreateCall(vctx.getModuleFunction("PushRegStack"), ArrayRef<Value*>(callParams, callParams + 3));
-	Value* newRlVal = builder.CreateSelect(
-		builder.CreateICmpULT(k, rLVal),
-		builder.CreateSub(rLVal, builder.CreateAdd(k, builder.getInt64(1))),
-		builder.CreateAdd(k, builder.getInt64(1)));
-	Value* specialRegisters = vctx.getModuleVar("SpecialRegisters");
-	Value* ix[2];
-	ix[0] = builder.getInt32(0);
-	ix[1] = builder.getInt32((int)MmixLlvm::rL);
-	builder.CreateStore(
-		newRlVal,
-		builder.CreatePointerCast(
-			builder.CreateGEP(specialRegisters, ArrayRef<Value*>(ix, ix + 2)), Type::getInt64PtrTy(ctx)));
-	std::vector<Argument*> args(vctx.getVerticeArgs());
-	builder.CreateStore(builder.getInt64(vctx.getXPtr()), args[0]);
-	builder.CreateStore(builder.getInt64(target), args[1]);
-	builder.CreateRetVoid();
+	pushRegs(vctx, builder, xarg);
+	leaveVerticeViaStaticExit(vctx, builder, target);
 }
 
 void MmixLlvm::Private::emitPushRegsAndLeaveVerticeViaIndirectJump(VerticeContext&vctx, 
 	MXByte xarg, IRBuilder<>& builder, Value* target)
 {
-	LLVMContext& ctx = vctx.getLctx();
-	Value* rLVal = vctx.getSpRegister(MmixLlvm::rL);
-	Value* k = builder.getInt64(xarg);
-	saveRegisters(vctx, builder);
-	Value* callParams[] = {
-		builder.CreateLoad(vctx.getModuleVar("ThisRef")),
-		builder.CreateAdd(k, builder.getInt64(1)),
-		vctx.getSpRegister(MmixLlvm::rL)
-	};
-	builder.CreateCall(vctx.getModuleFunction("PushRegStack"), ArrayRef<Value*>(callParams, callParams + 3));
-	Value* newRlVal = builder.CreateSelect(
-		builder.CreateICmpULT(k, rLVal),
-		builder.CreateSub(rLVal, builder.CreateAdd(k, builder.getInt64(1))),
-		builder.CreateAdd(k, builder.getInt64(1)));
-	Value* specialRegisters = vctx.getModuleVar("SpecialRegisters");
-	Value* ix[2];
-	ix[0] = builder.getInt32(0);
-	ix[1] = builder.getInt32((int)MmixLlvm::rL);
-	builder.CreateStore(
-		newRlVal,
-		builder.CreatePointerCast(
-			builder.CreateGEP(specialRegisters, ArrayRef<Value*>(ix, ix + 2)), Type::getInt64PtrTy(ctx)));
-	std::vector<Argument*> args(vctx.getVerticeArgs());
-	builder.CreateStore(builder.getInt64(vctx.getXPtr()), args[0]);
-	builder.CreateStore(target, args[1]);
-	builder.CreateRetVoid();
+	pushRegs(vctx, builder, xarg);
+	leaveVerticeViaDynamicExit(vctx, builder, target, 0);
 }
 
 void MmixLlvm::Private::emitLeaveVerticeViaPop(VerticeContext& vctx, IRBuilder<>& builder, 
@@ -207,11 +372,12 @@ void MmixLlvm::Private::emitLeaveVerticeViaPop(VerticeContext& vctx, IRBuilder<>
 	Value* callParams[] = {
 		builder.CreateLoad(vctx.getModuleVar("ThisRef")),
 		retainLocalRegs,
-		newRlVal
+		newRlVal,
+		target
 	};
 	Value* specialRegisters = vctx.getModuleVar("SpecialRegisters");
-	builder.CreateCall(vctx.getModuleFunction("PopRegStack"), ArrayRef<Value*>(callParams, callParams + 3));
-	std::vector<Argument*> args(vctx.getVerticeArgs());
+	Value* predictedEntry = builder.CreateCall(vctx.getModuleFunction("PopRegStack"),
+		ArrayRef<Value*>(callParams, callParams + 4));
 	Value* ix[2];
 	ix[0] = builder.getInt32(0);
 	ix[1] = builder.getInt32((int)MmixLlvm::rL);
@@ -219,58 +385,49 @@ void MmixLlvm::Private::emitLeaveVerticeViaPop(VerticeContext& vctx, IRBuilder<>
 		builder.CreateLoad(newRlVal, false),
 		builder.CreatePointerCast(
 			builder.CreateGEP(specialRegisters, ArrayRef<Value*>(ix, ix + 2)), Type::getInt64PtrTy(ctx)));
-	builder.CreateStore(builder.getInt64(vctx.getXPtr()), args[0]);
-	builder.CreateStore(target, args[1]);
-	builder.CreateRetVoid();
+	leaveVerticeViaDynamicExit(vctx, builder, target, predictedEntry);
 }
 
 void MmixLlvm::Private::emitLeaveVerticeViaIndirectJump(VerticeContext& vctx, IRBuilder<>& builder, Value* target) 
 {
 	saveRegisters(vctx, builder);
-	std::vector<Argument*> args(vctx.getVerticeArgs());
-	builder.CreateStore(builder.getInt64(vctx.getXPtr()), args[0]);
-	builder.CreateStore(target, args[1]);
-	builder.CreateRetVoid();
+	leaveVerticeViaDynamicExit(vctx, builder, target, 0);
 }
 
 Value* MmixLlvm::Private::emitFetchMem(VerticeContext& vctx, IRBuilder<>& builder, Value* theA, Type* ty) 
 {
-	Value* glob = vctx.getModuleVar("AddressTranslateTable");
 	Value* ix[2];
 	ix[0] = builder.getInt32(0);
-	ix[1] = builder.CreateIntCast(
-		builder.CreateAnd(
-			builder.CreateLShr(theA, REGION_BIT_OFFSET),
-			builder.getInt64(TWO_ENABLED_BITS)),
-			Type::getInt32Ty(vctx.getLctx()), false);
-	Value *attVal = builder.CreateLoad(builder.CreateGEP(glob, ArrayRef<Value*>(ix, ix + 2)));
-	glob = vctx.getModuleVar("Memory");
-	Value* normAddr = builder.CreateIntCast(builder.CreateAnd(theA, builder.getInt64(ADDR_MASK)), Type::getInt32Ty(vctx.getLctx()), false);
-	ix[1] = builder.CreateAdd(normAddr, attVal);
+	ix[1] = emitGuestOffset(vctx, builder, emitHostAddr(vctx, builder, theA, ty));
 	Value* targetPtr = builder.CreatePointerCast(
-		builder.CreateGEP(glob, ArrayRef<Value*>(ix, ix + 2)), PointerType::get(ty, 0)); 
+		builder.CreateGEP(vctx.getModuleVar("Memory"), ArrayRef<Value*>(ix, ix + 2)), PointerType::get(ty, 0)); 
 	return builder.CreateLoad(targetPtr);
 }
 
 void MmixLlvm::Private::emitStoreMem(VerticeContext& vctx, IRBuilder<>& builder, Value* theA, Value* val)
 {
-	Value* glob = vctx.getModuleVar("AddressTranslateTable");
 	Value* ix[2];
 	ix[0] = builder.getInt32(0);
-	ix[1] = builder.CreateIntCast(
-		builder.CreateAnd(
-			builder.CreateLShr(theA, REGION_BIT_OFFSET),
-			builder.getInt64(TWO_ENABLED_BITS)),
-				Type::getInt32Ty(vctx.getLctx()), false);
-	Value *attVal = builder.CreateLoad(builder.CreateGEP(glob, ArrayRef<Value*>(ix, ix + 2)));
-	glob = vctx.getModuleVar("Memory");
-	Value* normAddr = builder.CreateIntCast(
-		builder.CreateAnd(theA, builder.getInt64(ADDR_MASK)), 
-			Type::getInt32Ty(vctx.getLctx()), false);
-	ix[1] = builder.CreateAdd(normAddr, attVal);
+	ix[1] = emitGuestOffset(vctx, builder, emitHostAddr(vctx, builder, theA, val->getType()));
 	Value* targetPtr = builder.CreatePointerCast(
-		builder.CreateGEP(glob, ArrayRef<Value*>(ix, ix + 2)), (*(*val).getType()).getPointerTo()); 
+		builder.CreateGEP(vctx.getModuleVar("Memory"), ArrayRef<Value*>(ix, ix + 2)), (*(*val).getType()).getPointerTo()); 
 	builder.CreateStore(val, targetPtr);
+	// Stores into a page holding translated code are reported, so that the
+	// dispatcher drops the stale vertices before running anything else
+	ix[1] = builder.CreateLShr(ix[1], builder.getInt64(MmixLlvm::CODE_PAGE_BITS));
+	Value* codePage = builder.CreateLoad(
+		builder.CreateGEP(vctx.getModuleVar("CodePages"), ArrayRef<Value*>(ix, ix + 2)));
+	BasicBlock *codeWritten = vctx.makeBlock("code_written");
+	BasicBlock *stored = vctx.makeBlock("stored");
+	builder.CreateCondBr(builder.CreateICmpNE(codePage, builder.getInt8(0)), codeWritten, stored);
+	builder.SetInsertPoint(codeWritten);
+	Value* callParams[] = {
+		builder.CreateLoad(vctx.getModuleVar("ThisRef")),
+		theA
+	};
+	builder.CreateCall(vctx.getModuleFunction("CodeWritten"), ArrayRef<Value*>(callParams, callParams + 2));
+	builder.CreateBr(stored);
+	builder.SetInsertPoint(stored);
 }
 
 MXOcta MmixLlvm::Private::getArithTripVector(ArithFlag flag) {
@@ -773,6 +930,12 @@ void MmixLlvm::Private::emitInstruction(VerticeContext& vctx, IRBuilder<>& build
 	case MmixLlvm::TRAP:
 		emitTrap(vctx, builder, xarg, yarg, zarg);
 		break;
+	case MmixLlvm::SYNCID:
+		emitSyncid(vctx, builder, xarg, yarg, zarg, false);
+		break;
+	case MmixLlvm::SYNCIDI:
+		emitSyncid(vctx, builder, xarg, yarg, zarg, true);
+		break;
 	case MmixLlvm::GETA:
 		emitGeta(vctx, builder, xarg, ((MXWyde)yarg << 8) | zarg, false);
 		break;
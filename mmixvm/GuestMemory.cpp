@@ -0,0 +1,152 @@
+#include "stdafx.h"
+#include "GuestMemory.h"
+#include <windows.h>
+
+using MmixLlvm::GuestMemory;
+using MmixLlvm::MXByte;
+
+namespace {
+	// Every live instance, looked up by the fault handler
+	std::vector<GuestMemory*> _regions;
+
+	CRITICAL_SECTION _regionsLock;
+
+	PVOID _handler = 0;
+
+	size_t _chunkSize = (size_t)1 << GuestMemory::CHUNK_BITS;
+};
+
+GuestMemory::GuestMemory(size_t size)
+	:_size((size + _chunkSize - 1) & ~(_chunkSize - 1))
+	,_chunks(_size >> CHUNK_BITS, (MXByte)RESERVED)
+{
+	_base = (MXByte*)VirtualAlloc(NULL, _size, MEM_RESERVE, PAGE_NOACCESS);
+	if (!_base)
+		throw std::bad_alloc();
+	if (!_handler) {
+		InitializeCriticalSection(&_regionsLock);
+		_handler = AddVectoredExceptionHandler(1, (PVECTORED_EXCEPTION_HANDLER)&GuestMemory::onFault);
+	}
+	EnterCriticalSection(&_regionsLock);
+	_regions.push_back(this);
+	LeaveCriticalSection(&_regionsLock);
+}
+
+MXByte* GuestMemory::base() const {
+	return _base;
+}
+
+size_t GuestMemory::size() const {
+	return _size;
+}
+
+// Chunk states change under _regionsLock, on whichever thread faults first,
+// so they are read under it as well.
+void GuestMemory::getCommitted(std::vector<size_t>& out) const {
+	out.clear();
+	EnterCriticalSection(&_regionsLock);
+	for (size_t i = 0; i < _chunks.size(); i++)
+		if (_chunks[i] == COMMITTED)
+			out.push_back(i);
+	LeaveCriticalSection(&_regionsLock);
+}
+
+void GuestMemory::decommit(size_t chunk) {
+	EnterCriticalSection(&_regionsLock);
+	VirtualFree(_base + (chunk << CHUNK_BITS), _chunkSize, MEM_DECOMMIT);
+	_chunks[chunk] = RESERVED;
+	LeaveCriticalSection(&_regionsLock);
+}
+
+void GuestMemory::protect(size_t offset, size_t size) {
+	size_t end = offset + size < _size ? offset + size : _size;
+	EnterCriticalSection(&_regionsLock);
+	for (size_t chunk = (offset + _chunkSize - 1) >> CHUNK_BITS; (chunk << CHUNK_BITS) < end; chunk++) {
+		if (_chunks[chunk] == COMMITTED)
+			VirtualFree(_base + (chunk << CHUNK_BITS), _chunkSize, MEM_DECOMMIT);
+		_chunks[chunk] = GUARD;
+	}
+	LeaveCriticalSection(&_regionsLock);
+}
+
+// Chunks only become guards in protect, before the guest runs, and a guard
+// never changes state again, so this reads without the lock.
+bool GuestMemory::isGuard(size_t offset) const {
+	if (offset >= _size)
+		return true;
+	return _chunks[offset >> CHUNK_BITS] == GUARD;
+}
+
+// Called by onFault with _regionsLock held.
+bool GuestMemory::commit(MXByte* addr) {
+	size_t chunk = (size_t)(addr - _base) >> CHUNK_BITS;
+	if (_chunks[chunk] == GUARD)
+		return false;
+	if (!VirtualAlloc(_base + (chunk << CHUNK_BITS), _chunkSize, MEM_COMMIT, PAGE_READWRITE))
+		return false;
+	_chunks[chunk] = COMMITTED;
+	return true;
+}
+
+// Entering costs one SEH registration record. On x86 handlers are found
+// through records chained on the stack, so generated code needs no unwind
+// information for the fault to get here; an x64 build would have to register
+// function tables for it first.
+bool GuestMemory::guardedCall(void (*fn)(void*), void* arg, GuardFault& fault) {
+	__try {
+		fn(arg);
+	} __except (filterGuardFault(GetExceptionInformation(), fault)) {
+		return false;
+	}
+	return true;
+}
+
+// Guard hits are left to the innermost guardedCall, which unwinds to itself.
+long GuestMemory::filterGuardFault(void* exceptionPointers, GuardFault& fault) {
+	EXCEPTION_POINTERS* pointers = (EXCEPTION_POINTERS*)exceptionPointers;
+	EXCEPTION_RECORD* record = pointers->ExceptionRecord;
+	if (record->ExceptionCode != EXCEPTION_ACCESS_VIOLATION || record->NumberParameters < 2)
+		return EXCEPTION_CONTINUE_SEARCH;
+	MXByte* addr = (MXByte*)record->ExceptionInformation[1];
+	GuestMemory* region = 0;
+	EnterCriticalSection(&_regionsLock);
+	for (size_t i = 0; i < _regions.size() && !region; i++)
+		if (addr >= _regions[i]->_base && addr < _regions[i]->_base + _regions[i]->_size)
+			region = _regions[i];
+	LeaveCriticalSection(&_regionsLock);
+	if (!region)
+		return EXCEPTION_CONTINUE_SEARCH;
+	fault.Offset = (size_t)(addr - region->_base);
+	fault.Write = record->ExceptionInformation[0] == 1;
+	fault.Pc = record->ExceptionAddress;
+	return EXCEPTION_EXECUTE_HANDLER;
+}
+
+// Runs before any frame based handler and commits reserved chunks on first
+// touch. Everything else, guard hits included, goes on to the frame based
+// handlers.
+long __stdcall GuestMemory::onFault(void* exceptionPointers) {
+	EXCEPTION_POINTERS* pointers = (EXCEPTION_POINTERS*)exceptionPointers;
+	EXCEPTION_RECORD* record = pointers->ExceptionRecord;
+	if (record->ExceptionCode != EXCEPTION_ACCESS_VIOLATION || record->NumberParameters < 2)
+		return EXCEPTION_CONTINUE_SEARCH;
+	MXByte* addr = (MXByte*)record->ExceptionInformation[1];
+	GuestMemory* region = 0;
+	bool served = false;
+	EnterCriticalSection(&_regionsLock);
+	for (size_t i = 0; i < _regions.size() && !region; i++) {
+		if (addr >= _regions[i]->_base && addr < _regions[i]->_base + _regions[i]->_size) {
+			region = _regions[i];
+			served = region->commit(addr);
+		}
+	}
+	LeaveCriticalSection(&_regionsLock);
+	return served ? EXCEPTION_CONTINUE_EXECUTION : EXCEPTION_CONTINUE_SEARCH;
+}
+
+GuestMemory::~GuestMemory() {
+	EnterCriticalSection(&_regionsLock);
+	_regions.erase(std::find(_regions.begin(), _regions.end(), this));
+	LeaveCriticalSection(&_regionsLock);
+	VirtualFree(_base, 0, MEM_RELEASE);
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <stdint.h>
+#include <vector>
+#include "MmixDef.h"
+
+namespace MmixLlvm {
+	// Address space reserved up front and committed a chunk at a time on
+	// first touch, so untouched memory costs neither RSS nor zeroing.
+	// Guard chunks are never committed: touching one from code run by
+	// guardedCall unwinds that code instead. Host code that takes guest
+	// addresses checks them up front rather than rely on this.
+	class GuestMemory {
+		MXByte* _base;
+
+		size_t _size;
+
+		// ChunkState per chunk, set by whichever thread faults first; only
+		// changed under the lock the fault handler takes
+		std::vector<MXByte> _chunks;
+
+		enum ChunkState { RESERVED, COMMITTED, GUARD };
+
+		GuestMemory(const GuestMemory&);
+
+		GuestMemory& operator=(const GuestMemory&);
+
+		bool commit(MXByte* addr);
+
+		static long __stdcall onFault(void* exceptionPointers);
+	public:
+		enum { CHUNK_BITS = 16 };
+
+		struct GuardFault {
+			// Offset of the faulting access within the region
+			size_t Offset;
+
+			bool Write;
+
+			// Host instruction that faulted
+			const void* Pc;
+		};
+
+		// Rounded up to whole chunks
+		GuestMemory(size_t size);
+
+		MXByte* base() const;
+
+		size_t size() const;
+
+		// Chunks committed so far, in address order
+		void getCommitted(std::vector<size_t>& out) const;
+
+		// Gives the chunk back; it reads as zeroes again
+		void decommit(size_t chunk);
+
+		// Turns the whole chunks within [offset, offset + size) into guards
+		void protect(size_t offset, size_t size);
+
+		bool isGuard(size_t offset) const;
+
+		// Runs fn(arg) on this thread. A guard fault inside it unwinds back
+		// here, describes itself in fault and makes the result false.
+		static bool guardedCall(void (*fn)(void*), void* arg, GuardFault& fault);
+
+		~GuestMemory();
+	private:
+		static long filterGuardFault(void* exceptionPointers, GuardFault& fault);
+	};
+};
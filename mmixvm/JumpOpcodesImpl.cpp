@@ -43,7 +43,8 @@ namespace {
 			target = vctx.getXPtr() + ((MXOcta)yzarg << 2);
 		else 
 			target = vctx.getXPtr() - ((MXOcta)yzarg << 2);
-		emitLeaveVerticeViaJump(vctx, builder, target);
+		if (!vctx.branchWithinVertice(builder, target))
+			emitLeaveVerticeViaJump(vctx, builder, target);
 	}
 };
 
@@ -56,7 +57,8 @@ void MmixLlvm::Private::emitJmp(VerticeContext& vctx, IRBuilder<>& builder,
 		target = vctx.getXPtr() + ((MXOcta)xyzarg << 2);
 	else 
 		target = vctx.getXPtr() - ((MXOcta)xyzarg << 2);
-	emitLeaveVerticeViaJump(vctx, builder, target);
+	if (!vctx.branchWithinVertice(builder, target))
+		emitLeaveVerticeViaJump(vctx, builder, target);
 }
 
 void MmixLlvm::Private::emitGo(VerticeContext& vctx, llvm::IRBuilder<>& builder,
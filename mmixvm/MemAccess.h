@@ -20,6 +20,9 @@ namespace MmixLlvm {
 
 		virtual void writeOcta(MXOcta ref, MXOcta arg) = 0;
 
+		// False where an access would raise a protection fault
+		virtual bool isMapped(MXOcta ref) = 0;
+
 		virtual ~MemAccessor() = 0;
 	};
 };
\ No newline at end of file
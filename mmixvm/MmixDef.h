@@ -1,6 +1,7 @@
 #pragma once
 
 #include <stdint.h>
+#include <string>
 
 namespace MmixLlvm {
 	typedef uint8_t MXByte;
@@ -81,6 +82,18 @@ namespace MmixLlvm {
 		D = 1<<7
 	};
 
+	// rwxnkbsp, raised in the high half of rQ by dynamic traps
+	enum ProgramBit {
+		P_BIT = 1,
+		S_BIT = 1<<1,
+		B_BIT = 1<<2,
+		K_BIT = 1<<3,
+		N_BIT = 1<<4,
+		X_BIT = 1<<5,
+		W_BIT = 1<<6,
+		R_BIT = 1<<7
+	};
+
 	struct HardwareCfg {
 		size_t TextSize;
 		
@@ -90,4 +103,171 @@ namespace MmixLlvm {
 
 		size_t StackSize;
 	};
+
+	struct JitCfg {
+		// Lets statically known vertice exits jump straight into the
+		// successor's native code instead of returning to the dispatcher.
+		bool EnableChaining;
+
+		// log2 of the number of entries in the direct-mapped translation
+		// cache probed by exit stubs and the dispatcher.
+		size_t TranslationCacheBits;
+
+		// Number of targets remembered by each GO, PUSHGO and POP site,
+		// zero disables inline caching.
+		size_t InlineCacheSize;
+
+		// Records the return vertice on PUSHJ/PUSHGO so POP can enter the
+		// caller's continuation without a lookup.
+		bool EnableReturnPrediction;
+
+		// Follows statically known JMP targets so a vertice can span
+		// several straight-line blocks, and turns branches back into the
+		// region into internal IR branches.
+		bool EnableSuperblocks;
+
+		// Instruction count after which no further JMP is followed.
+		size_t SuperblockMaxInstrs;
+
+		// Number of JMPs followed per vertice.
+		size_t SuperblockMaxJumps;
+
+		// Keeps the registers of loops closed inside a vertice in SSA phis
+		// instead of spilling them on every back edge.
+		bool EnableLoopRegisters;
+
+		// Per-vertice pass pipeline and codegen level: 0 runs no passes,
+		// 1 cleans up (instcombine, simplifycfg), 2 also runs GVN and DSE.
+		unsigned OptLevel;
+
+		// Entries after which a vertice compiled without optimization is
+		// recompiled at OptLevel, zero compiles at OptLevel right away.
+		uint64_t TierUpThreshold;
+
+		// Executions a block spends in the interpreter before it is handed
+		// to the JIT, zero compiles every block on first use.
+		uint64_t InterpThreshold;
+
+		// Background compiler threads, zero compiles on the guest thread.
+		unsigned CompileThreads;
+
+		// Queue the static successors of every new vertice on the compile
+		// workers before the guest reaches them. Successors are found through
+		// chaining edges, so this needs CompileThreads and EnableChaining.
+		bool EnableSpeculation;
+
+		// Vertices statically reachable from a miss compiled in the same
+		// job, one or zero compiles just the missed vertice. With the
+		// interpreter on, only ones it has run warm are taken along.
+		unsigned BatchBudget;
+
+		// Machine code kept for live vertices before the coldest are
+		// evicted, zero for no limit.
+		uint64_t CodeCacheBytes;
+
+		// Directory keeping optimized vertice bitcode across runs, empty
+		// disables the persistent cache.
+		std::string CacheDir;
+
+		// Compiles everything statically reachable from the entry point
+		// inside the text sections at OptLevel before the guest starts;
+		// indirect targets missed are left to the JIT. No executable comes
+		// out of it, the code lands in the persistent cache for later runs.
+		bool EnableAot;
+
+		// Vertices compiled ahead of time at most
+		unsigned AotBudget;
+
+		// Keeps every octabyte of guest memory in host byte order; narrower
+		// units are found by XOR-ing the low address bits, so aligned loads
+		// and stores of any width need no swap.
+		bool NativeByteOrder;
+
+		// Vertices poll for a stop request on entry and on every loop back
+		// edge, so another thread can stop a guest spinning in compiled
+		// code. Costs a load and a branch at each.
+		bool EnablePreemption;
+
+		// Counts chained and unchained exits and translation and inline
+		// cache hits in the emitted exit paths; only -stats reads them.
+		bool EnableExitCounters;
+
+		// Offset mask of the power of two slot every guest segment sits in,
+		// filled in by MmixHwImpl from its HardwareCfg
+		MXOcta SegmentOffsetMask;
+
+		// Bitcode of the helper library (MmixRuntime.bc) inlined into
+		// optimized vertices, empty leaves every helper an opaque call.
+		std::string RuntimeBitcode;
+	};
+
+	struct JitStats {
+		uint64_t ChainedExits;
+
+		uint64_t UnchainedExits;
+
+		uint64_t TranslationCacheHits;
+
+		uint64_t TranslationCacheMisses;
+
+		uint64_t InlineCacheHits;
+
+		uint64_t InlineCacheMisses;
+
+		uint64_t ReturnPredictionHits;
+
+		uint64_t ReturnPredictionMisses;
+
+		uint64_t CompiledVertices;
+
+		// IR instructions left after the pass pipeline
+		uint64_t IrInstructions;
+
+		uint64_t NativeCodeBytes;
+
+		// Estimated IR emitted, and what of it outlives codegen
+		uint64_t IrBytes;
+
+		uint64_t RetainedIrBytes;
+
+		// Host side vertice records, link cells and cache slots
+		uint64_t MetadataBytes;
+
+		uint64_t Evictions;
+
+		// Compiles of addresses whose code had been evicted
+		uint64_t Recompiles;
+
+		// Vertices dropped because the guest wrote to their code or ran
+		// SYNCID over it
+		uint64_t Invalidations;
+
+		// Vertices loaded from and written to the persistent cache
+		uint64_t PersistentCacheHits;
+
+		uint64_t PersistentCacheStores;
+
+		// Vertices compiled ahead of time, before the first guest instruction
+		uint64_t AheadOfTimeVertices;
+
+		// Loads, stores and jumps that left their segment
+		uint64_t ProtectionFaults;
+
+		// Wall time spent emitting, optimizing and generating code
+		uint64_t CompileMicroseconds;
+
+		// Vertices recompiled at OptLevel after turning hot
+		uint64_t TierUps;
+
+		uint64_t InterpretedBlocks;
+
+		uint64_t SpeculativeCompiles;
+
+		// Speculative compiles the guest went on to run
+		uint64_t SpeculativeUsed;
+
+		// Speculative compiles dropped unused: invalidated, or over the limit
+		// of vertices waiting for the guest
+		uint64_t SpeculativeWasted;
+	};
 };
\ No newline at end of file
@@ -10,24 +10,48 @@ using llvm::Type;
 using llvm::PointerType;
 using llvm::Value;
 using llvm::Function;
+using llvm::GlobalVariable;
+using llvm::GlobalValue;
+using llvm::Constant;
+using llvm::ConstantArray;
+using llvm::ConstantStruct;
+using llvm::ConstantInt;
+using llvm::StructType;
+using llvm::ArrayType;
 using llvm::BasicBlock;
+using llvm::PHINode;
 using llvm::IRBuilder;
 using llvm::ArrayRef;
 using llvm::cast;
 using llvm::Twine;
+using llvm::MDNode;
+using llvm::NamedMDNode;
+using llvm::MDString;
+using llvm::DebugLoc;
 
 using namespace MmixLlvm::Util;
 using namespace MmixLlvm::Private;
+using MmixLlvm::Edge;
 using MmixLlvm::EdgeList;
+using MmixLlvm::InlineCache;
+using MmixLlvm::InlineCacheList;
+using MmixLlvm::JitCfg;
+using MmixLlvm::Vertice;
 using MmixLlvm::MemAccessor;
 using MmixLlvm::SpecialReg;
 using MmixLlvm::MXByte;
 using MmixLlvm::MXWyde;
 using MmixLlvm::MXTetra;
 using MmixLlvm::MXOcta;
+using MmixLlvm::FaultMap;
 using llvm::Intrinsic::ID;
 
 namespace {
+	// Bump whenever emitted code changes for the same guest instructions
+	const uint64_t EMITTER_VERSION = 9;
+
+	const char* const VERTICE_INFO = "mmixvm.vertice";
+
 	class SimpleVerticeContext : public VerticeContext {
 		LLVMContext& _lctx;
 
@@ -35,6 +59,12 @@ namespace {
 
 		Function& _func;
 
+		const JitCfg& _cfg;
+
+		EdgeList& _edges;
+
+		InlineCacheList& _inlineCaches;
+
 		MXOcta _xptr;
 		
 		MXTetra _opcode;
@@ -47,6 +77,10 @@ namespace {
 
 		BasicBlock *_exit;
 
+		// Block that receives lazily emitted register loads: the function
+		// prologue, or the header block of the last join point entered.
+		BasicBlock *_loadBlock;
+
 		const VerticeContext* _trunk;
 
 		struct RegisterRecord {
@@ -63,11 +97,38 @@ namespace {
 
 		SRefMap _spRegMap;
 
+		struct JoinRecord {
+			// Holds the phis, then falls into Body once emission is done
+			BasicBlock* Header;
+
+			BasicBlock* Body;
+
+			std::vector<std::pair<MXByte, PHINode*> > RegPhis;
+
+			std::vector<std::pair<SpecialReg, PHINode*> > SpRegPhis;
+
+			// Set once emission reaches the join; branches to it after that
+			// close a loop
+			bool Entered;
+		};
+
+		typedef boost::unordered_map<MXOcta, JoinRecord> JoinMap;
+
+		// Shared with branch contexts, which add incoming edges to the phis
+		boost::shared_ptr<JoinMap> _joins;
+
+		bool isCarried(const JoinRecord& j0, MXByte reg);
+
+		bool isCarried(const JoinRecord& j0, SpecialReg sreg);
+
 		std::vector<std::string> _twines;
 
 		Twine getInstrTwine(MXTetra instr, MXOcta xptr);
+
+		GlobalVariable* makeEdge(MXOcta target);
 	public:
-		SimpleVerticeContext(LLVMContext& lctx, Module& module, Function& func);
+		SimpleVerticeContext(LLVMContext& lctx, Module& module, Function& func,
+			const JitCfg& cfg, EdgeList& edges, InlineCacheList& inlineCaches);
 
 		SimpleVerticeContext(const SimpleVerticeContext& o);
 
@@ -75,12 +136,18 @@ namespace {
 
 		virtual void feedNewOpcode(MXOcta xptr, MXTetra opcode, bool term);
 
+		void addJoin(MXOcta xptr, const std::vector<MXByte>& loopRegs);
+
+		void enterJoin();
+
 		virtual MXTetra getInstr();
 
 		virtual MXOcta getXPtr();
 
 		virtual LLVMContext& getLctx();
 
+		virtual const JitCfg& getCfg();
+
 		virtual Value* getModuleVar(const char* varName);
 
 		virtual Function* getModuleFunction(const char* varName);
@@ -103,6 +170,14 @@ namespace {
 
 		virtual void assignSpRegister(SpecialReg reg, llvm::Value* val);
 
+		virtual Value* getEdgeLink(MXOcta target);
+
+		virtual Value* getInlineCache();
+
+		virtual Value* getReturnLink(MXOcta target);
+
+		virtual bool branchWithinVertice(IRBuilder<>& builder, MXOcta target);
+
 		virtual std::vector<MXByte> getDirtyRegisters();
 
 		virtual std::vector<SpecialReg> getDirtySpRegisters();
@@ -112,34 +187,46 @@ namespace {
 		virtual boost::shared_ptr<VerticeContext> makeBranch();
 	};
 
-	SimpleVerticeContext::SimpleVerticeContext(LLVMContext& lctx, Module& module, Function& func)
+	SimpleVerticeContext::SimpleVerticeContext(LLVMContext& lctx, Module& module, Function& func,
+		const JitCfg& cfg, EdgeList& edges, InlineCacheList& inlineCaches)
 		:_lctx(lctx)
 		,_module(module)
 		,_func(func)
+		,_cfg(cfg)
+		,_edges(edges)
+		,_inlineCaches(inlineCaches)
 		,_xptr(0)
 		,_opcode(0)
 		,_init(0)
 		,_entry(0)
 		,_exit(0)
+		,_loadBlock(0)
 		,_trunk(NULL)
+		,_joins(new JoinMap())
 	{
 		_init = BasicBlock::Create(_lctx, genUniq("init") + Twine(_xptr), &_func);
 		_entry = BasicBlock::Create(_lctx, genUniq("entry") + Twine(_xptr), &_func);
 		_mainEntry = _entry;
+		_loadBlock = _init;
 	}
 
 	SimpleVerticeContext::SimpleVerticeContext(const SimpleVerticeContext& o)
 		:_lctx(o._lctx)
 		,_module(o._module)
 		,_func(o._func)
+		,_cfg(o._cfg)
+		,_edges(o._edges)
+		,_inlineCaches(o._inlineCaches)
 		,_xptr(o._xptr)
 		,_opcode(o._opcode)
 		,_init(o._init)
 		,_entry(o._entry)
 		,_exit(o._exit)
 		,_mainEntry(o._mainEntry)
+		,_loadBlock(o._loadBlock)
 		,_regMap(o._regMap)
 		,_spRegMap(o._spRegMap)
+		,_joins(o._joins)
 		,_trunk(&o)
 	{}
 
@@ -149,6 +236,10 @@ namespace {
 			IRBuilder<> builder(_lctx);
 			builder.SetInsertPoint(_init);
 			builder.CreateBr(_mainEntry);
+			for (JoinMap::iterator itr = _joins->begin(); itr != _joins->end(); ++itr) {
+				builder.SetInsertPoint(itr->second.Header);
+				builder.CreateBr(itr->second.Body);
+			}
 		}
 	}
 
@@ -161,6 +252,86 @@ namespace {
 		_exit = !term ? BasicBlock::Create(_lctx, getInstrTwine(_opcode, _xptr), &_func) : 0;
 	}
 
+	// Registers used inside a loop are carried around it in phis; everything
+	// else goes through memory at the join.
+	void SimpleVerticeContext::addJoin(MXOcta xptr, const std::vector<MXByte>& loopRegs) {
+		JoinRecord& j0 = (*_joins)[xptr];
+		j0.Header = BasicBlock::Create(_lctx, genUniq("header"), &_func);
+		j0.Body = BasicBlock::Create(_lctx, genUniq("join"), &_func);
+		j0.Entered = false;
+		if (loopRegs.empty())
+			return;
+		for (std::vector<MXByte>::const_iterator itr = loopRegs.begin(); itr != loopRegs.end(); ++itr)
+			j0.RegPhis.push_back(std::make_pair(*itr,
+				PHINode::Create(Type::getInt64Ty(_lctx), 2, genUniq("reg"), j0.Header)));
+		SpecialReg spRegs[] = { MmixLlvm::rG, MmixLlvm::rL };
+		for (size_t i = 0; i < sizeof(spRegs) / sizeof(spRegs[0]); i++)
+			j0.SpRegPhis.push_back(std::make_pair(spRegs[i],
+				PHINode::Create(Type::getInt64Ty(_lctx), 2, genUniq("sreg"), j0.Header)));
+	}
+
+	bool SimpleVerticeContext::isCarried(const JoinRecord& j0, MXByte reg) {
+		for (size_t i = 0; i < j0.RegPhis.size(); i++)
+			if (j0.RegPhis[i].first == reg)
+				return true;
+		return false;
+	}
+
+	bool SimpleVerticeContext::isCarried(const JoinRecord& j0, SpecialReg sreg) {
+		for (size_t i = 0; i < j0.SpRegPhis.size(); i++)
+			if (j0.SpRegPhis[i].first == sreg)
+				return true;
+		return false;
+	}
+
+	bool SimpleVerticeContext::branchWithinVertice(IRBuilder<>& builder, MXOcta target) {
+		JoinMap::iterator jtr = _joins->find(target);
+		if (jtr == _joins->end())
+			return false;
+		const JoinRecord& j0 = jtr->second;
+		// A loop inside the vertice never passes its entry again
+		if (j0.Entered && _cfg.EnablePreemption)
+			emitPollPreempt(*this, builder, target);
+		std::vector<Value*> regVals, spRegVals;
+		for (size_t i = 0; i < j0.RegPhis.size(); i++)
+			regVals.push_back(getRegister(j0.RegPhis[i].first));
+		for (size_t i = 0; i < j0.SpRegPhis.size(); i++)
+			spRegVals.push_back(getSpRegister(j0.SpRegPhis[i].first));
+		for (RefMap::iterator itr = _regMap.begin(); itr != _regMap.end(); ++itr)
+			if (itr->second.Dirty && !isCarried(j0, itr->first))
+				emitSaveRegister(*this, builder, itr->first);
+		for (SRefMap::iterator itr = _spRegMap.begin(); itr != _spRegMap.end(); ++itr)
+			if (itr->second.Dirty && !isCarried(j0, itr->first))
+				emitSaveSpRegister(*this, builder, itr->first);
+		BasicBlock* pred = builder.GetInsertBlock();
+		for (size_t i = 0; i < j0.RegPhis.size(); i++)
+			j0.RegPhis[i].second->addIncoming(regVals[i], pred);
+		for (size_t i = 0; i < j0.SpRegPhis.size(); i++)
+			j0.SpRegPhis[i].second->addIncoming(spRegVals[i], pred);
+		builder.CreateBr(j0.Header);
+		return true;
+	}
+
+	// Control reaches a join point from several places: only the phis
+	// dominate what follows, every other register is reloaded from memory.
+	// The phis are marked dirty since a later back edge may bring in a value
+	// that is not in memory yet.
+	void SimpleVerticeContext::enterJoin() {
+		IRBuilder<> builder(_lctx);
+		builder.SetInsertPoint(_entry);
+		branchWithinVertice(builder, _xptr);
+		JoinRecord& j0 = (*_joins)[_xptr];
+		j0.Entered = true;
+		_regMap.clear();
+		_spRegMap.clear();
+		for (size_t i = 0; i < j0.RegPhis.size(); i++)
+			assignRegister(j0.RegPhis[i].first, j0.RegPhis[i].second);
+		for (size_t i = 0; i < j0.SpRegPhis.size(); i++)
+			assignSpRegister(j0.SpRegPhis[i].first, j0.SpRegPhis[i].second);
+		_loadBlock = j0.Header;
+		_entry = j0.Body;
+	}
+
 	MXTetra SimpleVerticeContext::getInstr() {
 		return _opcode;
 	}
@@ -173,6 +344,10 @@ namespace {
 		return _lctx;
 	}
 
+	const JitCfg& SimpleVerticeContext::getCfg() {
+		return _cfg;
+	}
+
 	Value* SimpleVerticeContext::getModuleVar(const char* varName) {
 		return _module.getGlobalVariable(varName);
 	}
@@ -206,7 +381,7 @@ namespace {
 
 	Value* SimpleVerticeContext::getRegister(MXByte reg) {
 		IRBuilder<> builder(_lctx);
-		builder.SetInsertPoint(_init);
+		builder.SetInsertPoint(_loadBlock);
 		RefMap::iterator itr = _regMap.find(reg);
 		Value *retVal;
 		if (itr == _regMap.end()) {
@@ -231,7 +406,7 @@ namespace {
 
 	Value* SimpleVerticeContext::getSpRegister(SpecialReg sreg) {
 		IRBuilder<> builder(_lctx);
-		builder.SetInsertPoint(_init);
+		builder.SetInsertPoint(_loadBlock);
 		Value *regGlob = _module.getGlobalVariable("SpecialRegisters");
 		SRefMap::iterator itr = _spRegMap.find(sreg);
 		Value *retVal;
@@ -267,6 +442,56 @@ namespace {
 		_spRegMap[sreg] = r0;
 	}
 
+	GlobalVariable* SimpleVerticeContext::makeEdge(MXOcta target) {
+		GlobalVariable* link = new GlobalVariable(_module,
+			_func.getType(),
+			false,
+			GlobalValue::InternalLinkage,
+			Constant::getNullValue(_func.getType()),
+			genUniq("link"));
+		Edge e0;
+		e0.Target = target;
+		e0.Link = link;
+		e0.Cell = 0;
+		_edges.push_back(e0);
+		return link;
+	}
+
+	Value* SimpleVerticeContext::getEdgeLink(MXOcta target) {
+		return _cfg.EnableChaining ? makeEdge(target) : 0;
+	}
+
+	Value* SimpleVerticeContext::getReturnLink(MXOcta target) {
+		return _cfg.EnableReturnPrediction ? makeEdge(target) : 0;
+	}
+
+	Value* SimpleVerticeContext::getInlineCache() {
+		if (_cfg.InlineCacheSize == 0)
+			return 0;
+		GlobalVariable* tcache = _module.getGlobalVariable("TranslationCache");
+		StructType* slotTy = cast<StructType>(
+			cast<ArrayType>(tcache->getType()->getElementType())->getElementType());
+		ArrayType* cacheTy = ArrayType::get(slotTy, _cfg.InlineCacheSize);
+		Constant* emptySlot[] = {
+			ConstantInt::get(slotTy->getElementType(0), ~0ULL),
+			Constant::getNullValue(slotTy->getElementType(1))
+		};
+		std::vector<Constant*> slots(_cfg.InlineCacheSize,
+			ConstantStruct::get(slotTy, ArrayRef<Constant*>(emptySlot, emptySlot + 2)));
+		GlobalVariable* slotsGlob = new GlobalVariable(_module,
+			cacheTy,
+			false,
+			GlobalValue::InternalLinkage,
+			ConstantArray::get(cacheTy, slots),
+			genUniq("icache"));
+		slotsGlob->setAlignment(8);
+		InlineCache ic;
+		ic.Slots = slotsGlob;
+		ic.Cells = 0;
+		_inlineCaches.push_back(ic);
+		return slotsGlob;
+	}
+
 	void SimpleVerticeContext::markAllClean() {
 		for (RefMap::iterator itr = _regMap.begin(); itr != _regMap.end(); ++itr)
 			itr->second.Dirty = false;
@@ -296,10 +521,14 @@ namespace {
 
 	Twine SimpleVerticeContext::getInstrTwine(MXTetra instr, MXOcta xptr)
 	{
+#ifdef NDEBUG
+		return Twine();
+#else
 		std::ostringstream oss;
 		oss<<"instr_"<<std::hex<<instr<<"@"<<xptr<<"#";
 		_twines.push_back(oss.str());
 		return genUniq(Twine(_twines.back()));
+#endif
 	}
 
 	bool isTerm(MXTetra instr) {
@@ -315,6 +544,8 @@ namespace {
 		case MmixLlvm::PUSHGOI:
 		case MmixLlvm::POP:
 		case MmixLlvm::TRIP:
+		case MmixLlvm::SYNCID:
+		case MmixLlvm::SYNCIDI:
 			return true;
 		case MmixLlvm::TRAP:
 			return instr == 0;
@@ -322,27 +553,453 @@ namespace {
 			return false;
 		}
 	}
+
+	bool isJmp(MXTetra instr) {
+		MXByte o0 = (MXByte) (instr >> 24);
+		return o0 == MmixLlvm::JMP || o0 == MmixLlvm::JMPB;
+	}
+
+	// Decodes the target of a JMP or a (probable) conditional branch the same
+	// way emitJmp and EmitBranch compute it.
+	bool getStaticTarget(MXOcta xptr, MXTetra instr, MXOcta& target) {
+		MXByte o0 = (MXByte) (instr >> 24);
+		MXOcta offset;
+		if (o0 >= MmixLlvm::BN && o0 <= MmixLlvm::PBEVB)
+			offset = (MXOcta)(instr & 0xFFFF) << 2;
+		else if (isJmp(instr))
+			offset = (MXOcta)(instr & 0xFFFFFF) << 2;
+		else
+			return false;
+		target = (o0 & 1) == 0 ? xptr + offset : xptr - offset;
+		return true;
+	}
+
+	struct TraceEntry {
+		MXOcta XPtr;
+
+		MXTetra Instr;
+
+		// JMP whose target is emitted next in the same function
+		bool Followed;
+	};
+
+	// Join address -> registers carried in phis when it heads a loop
+	typedef boost::unordered_map<MXOcta, std::vector<MXByte> > JoinTable;
+
+	struct Region {
+		std::vector<TraceEntry> Trace;
+
+		// Addresses inside the region reached by more than straight-line flow
+		JoinTable Joins;
+
+		// The trace ends by falling through into an address already emitted
+		bool FallsInto;
+
+		MXOcta FallsIntoXPtr;
+	};
+
+	// Collects the general registers an instruction may touch. This errs on
+	// the side of too many: an extra phi costs one load per vertice entry.
+	void addRegisterOperands(MXTetra instr, std::vector<MXByte>& regs) {
+		MXByte o0 = (MXByte) (instr >> 24);
+		if (isJmp(instr))
+			return;
+		regs.push_back((MXByte) (instr >> 16));
+		if ((o0 >= MmixLlvm::BN && o0 <= MmixLlvm::PBEVB) || o0 >= 0xE0)
+			return;
+		regs.push_back((MXByte) (instr >> 8));
+		if ((o0 & 1) == 0)
+			regs.push_back((MXByte) instr);
+	}
+
+	// A region branch whose target was emitted no later than itself closes a
+	// natural loop; the registers used between the two become its phis.
+	void addLoop(const JitCfg& cfg, Region& out, size_t header, size_t latch) {
+		if (!cfg.EnableLoopRegisters)
+			return;
+		std::vector<MXByte>& regs = out.Joins[out.Trace[header].XPtr];
+		for (size_t i = header; i <= latch; i++)
+			addRegisterOperands(out.Trace[i].Instr, regs);
+		std::sort(regs.begin(), regs.end());
+		regs.erase(std::unique(regs.begin(), regs.end()), regs.end());
+	}
+
+	// Debug lines are 23 bits wide; 0 stands for an instruction too far away
+	enum { LINE_BIAS = 1 << 21 };
+
+	unsigned getGuestLine(MXOcta xPtr, MXOcta instrPtr) {
+		int64_t distance = (int64_t)(instrPtr - xPtr) >> 2;
+		return distance > -LINE_BIAS && distance < LINE_BIAS ? (unsigned)(distance + LINE_BIAS) : 0;
+	}
+
+	void emitRegion(LLVMContext& ctx, Module& m, Function& f, const JitCfg& cfg,
+		const Region& region, Vertice& out)
+	{
+		SimpleVerticeContext vctx(ctx, m, f, cfg, out.EdgeList, out.InlineCaches);
+		for (JoinTable::const_iterator itr = region.Joins.begin(); itr != region.Joins.end(); ++itr)
+			vctx.addJoin(itr->first, itr->second);
+		vctx.getSpRegister(MmixLlvm::rL);
+		MDNode* scope = MDNode::get(ctx, ArrayRef<Value*>(MDString::get(ctx, "mmix")));
+		for (size_t i = 0; i < region.Trace.size(); i++) {
+			const TraceEntry& t0 = region.Trace[i];
+			bool term = i + 1 == region.Trace.size() && !region.FallsInto;
+			vctx.feedNewOpcode(t0.XPtr, t0.Instr, term);
+			if (region.Joins.find(t0.XPtr) != region.Joins.end())
+				vctx.enterJoin();
+			IRBuilder<> builder(ctx);
+			builder.SetInsertPoint(vctx.getOCEntry());
+			builder.SetCurrentDebugLocation(DebugLoc::get(getGuestLine(region.Trace[0].XPtr, t0.XPtr), 0, scope));
+			if (t0.Followed)
+				builder.CreateBr(vctx.getOCExit());
+			else
+				emitInstruction(vctx, builder);
+		}
+		if (region.FallsInto) {
+			IRBuilder<> builder(ctx);
+			builder.SetInsertPoint(vctx.getOCExit());
+			vctx.branchWithinVertice(builder, region.FallsIntoXPtr);
+		}
+	}
+
+	// Tier 0 code counts its entries. On reaching the threshold it hands its
+	// own address to the dispatcher through HotVertice instead of running.
+	GlobalVariable* emitHotnessCounter(LLVMContext& ctx, Module& m, Function& f,
+		const JitCfg& cfg, MXOcta xPtr)
+	{
+		GlobalVariable* counter = new GlobalVariable(m,
+			Type::getInt64Ty(ctx),
+			false,
+			GlobalValue::InternalLinkage,
+			ConstantInt::get(Type::getInt64Ty(ctx), 0),
+			genUniq("hits"));
+		counter->setAlignment(8);
+		BasicBlock* body = &f.getEntryBlock();
+		BasicBlock* prologue = BasicBlock::Create(ctx, genUniq("count"), &f, body);
+		BasicBlock* hot = BasicBlock::Create(ctx, genUniq("hot"), &f, body);
+		IRBuilder<> builder(prologue);
+		Value* hits = builder.CreateAdd(builder.CreateLoad(counter, false), builder.getInt64(1));
+		builder.CreateStore(hits, counter);
+		builder.CreateCondBr(builder.CreateICmpEQ(hits, builder.getInt64(cfg.TierUpThreshold)), hot, body);
+		builder.SetInsertPoint(hot);
+		Function::arg_iterator args = f.arg_begin();
+		Value* instrAddr = &*args++;
+		Value* targetAddr = &*args;
+		builder.CreateStore(builder.getInt64(xPtr), instrAddr);
+		builder.CreateStore(builder.getInt64(xPtr), targetAddr);
+		builder.CreateStore(builder.getInt64(xPtr), m.getGlobalVariable("HotVertice"));
+		builder.CreateRetVoid();
+		return counter;
+	}
+
+	// Hands the vertice's own address back to the dispatcher before doing
+	// anything once the host asks the guest to stop.
+	void emitEntryPoll(LLVMContext& ctx, Module& m, Function& f, MXOcta xPtr) {
+		BasicBlock* body = &f.getEntryBlock();
+		BasicBlock* prologue = BasicBlock::Create(ctx, genUniq("poll"), &f, body);
+		BasicBlock* stop = BasicBlock::Create(ctx, genUniq("stop"), &f, body);
+		IRBuilder<> builder(prologue);
+		Value* preempt = builder.CreateLoad(m.getGlobalVariable("Preempt"), true);
+		builder.CreateCondBr(builder.CreateIsNotNull(preempt), stop, body);
+		builder.SetInsertPoint(stop);
+		Function::arg_iterator args = f.arg_begin();
+		Value* instrAddr = &*args++;
+		Value* targetAddr = &*args;
+		builder.CreateStore(builder.getInt64(xPtr), instrAddr);
+		builder.CreateStore(builder.getInt64(xPtr), targetAddr);
+		builder.CreateRetVoid();
+	}
+
+	// With a bounded code cache every entry stamps the dispatcher epoch, so
+	// the coldest vertices can be told apart.
+	GlobalVariable* emitUseStamp(LLVMContext& ctx, Module& m, Function& f) {
+		GlobalVariable* lastUse = new GlobalVariable(m,
+			Type::getInt64Ty(ctx),
+			false,
+			GlobalValue::InternalLinkage,
+			ConstantInt::get(Type::getInt64Ty(ctx), 0),
+			genUniq("last_use"));
+		lastUse->setAlignment(8);
+		BasicBlock* body = &f.getEntryBlock();
+		BasicBlock* prologue = BasicBlock::Create(ctx, genUniq("stamp"), &f, body);
+		IRBuilder<> builder(prologue);
+		builder.CreateStore(builder.CreateLoad(m.getGlobalVariable("CodeCacheEpoch"), false), lastUse);
+		builder.CreateBr(body);
+		return lastUse;
+	}
+
+	// Where formRegion gets its instructions: through an engine, recording
+	// every word read, or from a snapshot recorded that way
+	class InstrSource {
+		MmixLlvm::Engine* _e;
+
+		MmixLlvm::CodeSnapshot* _record;
+
+		const MmixLlvm::CodeSnapshot& _code;
+	public:
+		InstrSource(const MmixLlvm::CodeSnapshot& code)
+			:_e(0)
+			,_record(0)
+			,_code(code)
+		{}
+
+		InstrSource(MmixLlvm::Engine& e, MmixLlvm::CodeSnapshot& record)
+			:_e(&e)
+			,_record(&record)
+			,_code(record)
+		{}
+
+		MXTetra fetch(MXOcta xPtr) {
+			if (_e == 0) {
+				boost::unordered_map<MXOcta, MXTetra>::const_iterator itr = _code.Words.find(xPtr);
+				return itr != _code.Words.end() ? itr->second : 0;
+			}
+			// Unmapped code decodes as TRAP 0,0,0 and ends the region
+			MXTetra instr = _e->isMapped(xPtr) ? _e->readTetra(xPtr) : 0;
+			_record->Words[xPtr] = instr;
+			return instr;
+		}
+	};
+
+	void formRegion(InstrSource& source, const JitCfg& cfg, MXOcta xPtr, Region& out) {
+		boost::unordered_map<MXOcta, size_t> inRegion;
+		size_t jumps = 0;
+		MXOcta xPtr0 = xPtr;
+		out.FallsInto = false;
+		for (;;) {
+			TraceEntry t0;
+			t0.XPtr = xPtr0;
+			t0.Instr = source.fetch(xPtr0);
+			t0.Followed = false;
+			inRegion[xPtr0] = out.Trace.size();
+			MXOcta target;
+			if (cfg.EnableSuperblocks && isJmp(t0.Instr) && getStaticTarget(xPtr0, t0.Instr, target)
+				&& inRegion.find(target) == inRegion.end()
+				&& jumps < cfg.SuperblockMaxJumps
+				&& out.Trace.size() < cfg.SuperblockMaxInstrs)
+			{
+				t0.Followed = true;
+				out.Trace.push_back(t0);
+				jumps++;
+				xPtr0 = target;
+				continue;
+			}
+			out.Trace.push_back(t0);
+			if (isTerm(t0.Instr))
+				break;
+			xPtr0 += sizeof(MXTetra);
+			if (inRegion.find(xPtr0) != inRegion.end()) {
+				out.FallsInto = true;
+				out.FallsIntoXPtr = xPtr0;
+				out.Joins[xPtr0];
+				addLoop(cfg, out, inRegion[xPtr0], out.Trace.size() - 1);
+				break;
+			}
+		}
+		if (!cfg.EnableSuperblocks)
+			return;
+		for (size_t i = 0; i < out.Trace.size(); i++) {
+			const TraceEntry& t0 = out.Trace[i];
+			MXOcta target;
+			if (t0.Followed || !getStaticTarget(t0.XPtr, t0.Instr, target))
+				continue;
+			boost::unordered_map<MXOcta, size_t>::iterator itr = inRegion.find(target);
+			if (itr == inRegion.end())
+				continue;
+			out.Joins[target];
+			if (itr->second <= i)
+				addLoop(cfg, out, itr->second, i);
+		}
+	}
 }
 
-void MmixLlvm::emitSimpleVertice(LLVMContext& ctx, Module& m, Engine& e, 
-	MXOcta xPtr, Vertice& out)
+const std::vector<MXOcta>& MmixLlvm::snapshotRegion(Engine& e, const JitCfg& cfg, MXOcta xPtr,
+	CodeSnapshot& out)
 {
-	MXOcta xPtr0 = xPtr;
+	boost::unordered_map<MXOcta, std::vector<MXOcta> >::iterator found = out.Regions.find(xPtr);
+	if (found != out.Regions.end())
+		return found->second;
+	std::vector<MXOcta> exits;
+	InstrSource source(e, out);
+	Region region;
+	formRegion(source, cfg, xPtr, region);
+	for (std::vector<TraceEntry>::iterator itr = region.Trace.begin(); itr != region.Trace.end(); ++itr) {
+		MXOcta target;
+		bool isStatic = !itr->Followed && getStaticTarget(itr->XPtr, itr->Instr, target);
+		if (isStatic)
+			exits.push_back(target);
+		// Branch fall-throughs, and where the last instruction continues or
+		// returns to
+		if ((isStatic && !isJmp(itr->Instr)) || itr + 1 == region.Trace.end())
+			exits.push_back(itr->XPtr + sizeof(MXTetra));
+	}
+	std::vector<MXOcta>& retVal = out.Regions[xPtr];
+	retVal.swap(exits);
+	return retVal;
+}
+
+void MmixLlvm::emitSimpleVertice(LLVMContext& ctx, Module& m, const CodeSnapshot& code, 
+	const JitCfg& cfg, unsigned tier, MXOcta xPtr, Vertice& out)
+{
+	InstrSource source(code);
+	Region region;
+	formRegion(source, cfg, xPtr, region);
 	Function* f = cast<Function>(m.getOrInsertFunction(genUniq("fun").str(), Type::getVoidTy(ctx),
 		Type::getInt64PtrTy(ctx),Type::getInt64PtrTy(ctx), (Type *)0));
-	SimpleVerticeContext vctx(ctx, m, *f);
-	vctx.getSpRegister(MmixLlvm::rL);
-	bool term = false;
-	while (!term) {
-		MXTetra instr = e.readTetra(xPtr0);
-		MXOcta xPtr1 = xPtr += sizeof(MXTetra);
-		term = isTerm(instr);
-		vctx.feedNewOpcode(xPtr0, instr, term);
-		LLVMContext& ctx = vctx.getLctx();
-		IRBuilder<> builder(ctx);
-		builder.SetInsertPoint(vctx.getOCEntry());
-		emitInstruction(vctx, builder);
-		xPtr0 = xPtr1;
-	}
+	out.EdgeList.clear();
+	out.InlineCaches.clear();
+	emitRegion(ctx, m, *f, cfg, region, out);
+	out.Tier = tier;
+	out.Counter = tier == 0 && cfg.TierUpThreshold > 0 ? emitHotnessCounter(ctx, m, *f, cfg, xPtr) : 0;
+	out.ExecCount = 0;
+	out.LastUseCell = cfg.CodeCacheBytes > 0 ? emitUseStamp(ctx, m, *f) : 0;
+	if (cfg.EnablePreemption)
+		emitEntryPoll(ctx, m, *f, xPtr);
+	out.LastUse = 0;
+	out.Unit = 0;
+	out.CodeBytes = 0;
+	out.IrBytes = 0;
+	out.MetadataBytes = 0;
+	out.CodePages.clear();
+	for (std::vector<TraceEntry>::iterator itr = region.Trace.begin(); itr != region.Trace.end(); ++itr)
+		out.CodePages.push_back(itr->XPtr >> CODE_PAGE_BITS << CODE_PAGE_BITS);
+	std::sort(out.CodePages.begin(), out.CodePages.end());
+	out.CodePages.erase(std::unique(out.CodePages.begin(), out.CodePages.end()), out.CodePages.end());
 	out.Function = f;
 }
+
+MXOcta MmixLlvm::getFaultingXPtr(const Vertice& v, MXOcta xPtr, size_t offset) {
+	MXTetra line = 0;
+	for (FaultMap::const_iterator itr = v.FaultMap.begin(); itr != v.FaultMap.end() && itr->first <= offset; ++itr)
+		line = itr->second;
+	return line != 0 ? xPtr + ((int64_t)line - LINE_BIAS) * 4 : xPtr;
+}
+
+namespace {
+	uint64_t hashMix(uint64_t hash, uint64_t val) {
+		// FNV-1a over the eight bytes of val
+		for (int i = 0; i < 8; i++) {
+			hash ^= (val >> (i * 8)) & 0xFF;
+			hash *= 1099511628211ULL;
+		}
+		return hash;
+	}
+}
+
+uint64_t MmixLlvm::hashBytes(const void* data, size_t size) {
+	const MXByte* bytes = (const MXByte*)data;
+	uint64_t hash = 14695981039346656037ULL;
+	hash = hashMix(hash, size);
+	for (size_t i = 0; i < size; i += 8) {
+		uint64_t word = 0;
+		for (size_t j = i; j < i + 8 && j < size; j++)
+			word |= (uint64_t)bytes[j] << ((j - i) * 8);
+		hash = hashMix(hash, word);
+	}
+	return hash;
+}
+
+uint64_t MmixLlvm::hashVerticeSource(const CodeSnapshot& code, const JitCfg& cfg, unsigned tier, uint64_t runtimeHash, MXOcta xPtr) {
+	uint64_t hash = 14695981039346656037ULL;
+	hash = hashMix(hash, EMITTER_VERSION);
+	hash = hashMix(hash, LLVM_VERSION_MAJOR * 100 + LLVM_VERSION_MINOR);
+	hash = hashMix(hash, tier);
+	hash = hashMix(hash, cfg.EnableChaining);
+	hash = hashMix(hash, cfg.TranslationCacheBits);
+	hash = hashMix(hash, cfg.InlineCacheSize);
+	hash = hashMix(hash, cfg.EnableReturnPrediction);
+	hash = hashMix(hash, cfg.EnableSuperblocks);
+	hash = hashMix(hash, cfg.SuperblockMaxInstrs);
+	hash = hashMix(hash, cfg.SuperblockMaxJumps);
+	hash = hashMix(hash, cfg.EnableLoopRegisters);
+	hash = hashMix(hash, cfg.OptLevel);
+	hash = hashMix(hash, cfg.TierUpThreshold);
+	hash = hashMix(hash, cfg.CodeCacheBytes > 0);
+	hash = hashMix(hash, cfg.NativeByteOrder);
+	hash = hashMix(hash, cfg.EnablePreemption);
+	hash = hashMix(hash, cfg.EnableExitCounters);
+	hash = hashMix(hash, cfg.SegmentOffsetMask);
+	hash = hashMix(hash, runtimeHash);
+	InstrSource source(code);
+	Region region;
+	formRegion(source, cfg, xPtr, region);
+	for (std::vector<TraceEntry>::iterator itr = region.Trace.begin(); itr != region.Trace.end(); ++itr) {
+		hash = hashMix(hash, itr->XPtr);
+		hash = hashMix(hash, itr->Instr);
+	}
+	return hash;
+}
+
+// One node per vertice: function, tier, counter, last use cell, then a node
+// per edge (target, link), the inline cache slot arrays and the code pages.
+void MmixLlvm::writeVerticeBitcode(Module& m, const Vertice& v, llvm::raw_ostream& os) {
+	LLVMContext& ctx = m.getContext();
+	std::vector<Value*> ops;
+	ops.push_back(v.Function);
+	ops.push_back(ConstantInt::get(Type::getInt32Ty(ctx), v.Tier));
+	ops.push_back(v.Counter);
+	ops.push_back(v.LastUseCell);
+	std::vector<Value*> edges;
+	for (EdgeList::const_iterator itr = v.EdgeList.begin(); itr != v.EdgeList.end(); ++itr) {
+		Value* edge[] = { ConstantInt::get(Type::getInt64Ty(ctx), itr->Target), itr->Link };
+		edges.push_back(MDNode::get(ctx, ArrayRef<Value*>(edge, edge + 2)));
+	}
+	ops.push_back(MDNode::get(ctx, edges));
+	std::vector<Value*> caches;
+	for (InlineCacheList::const_iterator itr = v.InlineCaches.begin(); itr != v.InlineCaches.end(); ++itr)
+		caches.push_back(itr->Slots);
+	ops.push_back(MDNode::get(ctx, caches));
+	std::vector<Value*> pages;
+	for (std::vector<MXOcta>::const_iterator itr = v.CodePages.begin(); itr != v.CodePages.end(); ++itr)
+		pages.push_back(ConstantInt::get(Type::getInt64Ty(ctx), *itr));
+	ops.push_back(MDNode::get(ctx, pages));
+	NamedMDNode* info = m.getOrInsertNamedMetadata(VERTICE_INFO);
+	info->addOperand(MDNode::get(ctx, ops));
+	llvm::WriteBitcodeToFile(&m, os);
+	m.eraseNamedMetadata(info);
+}
+
+bool MmixLlvm::detachVerticeInfo(Module& m, Vertice& out) {
+	NamedMDNode* info = m.getNamedMetadata(VERTICE_INFO);
+	if (!info || info->getNumOperands() != 1)
+		return false;
+	MDNode* node = info->getOperand(0);
+	if (node->getNumOperands() != 7)
+		return false;
+	out.Function = llvm::dyn_cast_or_null<Function>(node->getOperand(0));
+	if (!out.Function)
+		return false;
+	out.Tier = (unsigned)cast<ConstantInt>(node->getOperand(1))->getZExtValue();
+	out.Counter = llvm::dyn_cast_or_null<GlobalVariable>(node->getOperand(2));
+	out.LastUseCell = llvm::dyn_cast_or_null<GlobalVariable>(node->getOperand(3));
+	out.EdgeList.clear();
+	MDNode* edges = cast<MDNode>(node->getOperand(4));
+	for (unsigned i = 0; i < edges->getNumOperands(); i++) {
+		MDNode* edge = cast<MDNode>(edges->getOperand(i));
+		Edge e0;
+		e0.Target = cast<ConstantInt>(edge->getOperand(0))->getZExtValue();
+		e0.Link = cast<GlobalVariable>(edge->getOperand(1));
+		e0.Cell = 0;
+		out.EdgeList.push_back(e0);
+	}
+	out.InlineCaches.clear();
+	MDNode* caches = cast<MDNode>(node->getOperand(5));
+	for (unsigned i = 0; i < caches->getNumOperands(); i++) {
+		InlineCache ic;
+		ic.Slots = cast<GlobalVariable>(caches->getOperand(i));
+		ic.Cells = 0;
+		out.InlineCaches.push_back(ic);
+	}
+	out.CodePages.clear();
+	MDNode* pages = cast<MDNode>(node->getOperand(6));
+	for (unsigned i = 0; i < pages->getNumOperands(); i++)
+		out.CodePages.push_back(cast<ConstantInt>(pages->getOperand(i))->getZExtValue());
+	out.Entry = 0;
+	out.ExecCount = 0;
+	out.LastUse = 0;
+	out.Unit = 0;
+	out.CodeBytes = 0;
+	out.IrBytes = 0;
+	out.MetadataBytes = 0;
+	m.eraseNamedMetadata(info);
+	return true;
+}
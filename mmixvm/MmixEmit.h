@@ -3,20 +3,130 @@
 #include <stdint.h>
 #include <vector>
 #include <boost/tuple/tuple.hpp>
+#include <boost/unordered_map.hpp>
 #include <llvm/IR/IRBuilder.h>
+#include <llvm/IR/GlobalVariable.h>
+#include <llvm/Support/raw_ostream.h>
 #include "Engine.h"
+#include "MmixDef.h"
 
 namespace MmixLlvm {
-	typedef std::vector<MXOcta> EdgeList;
+	typedef void (*VerticeEntry)(MXOcta* a, MXOcta* b);
+
+	// Granule in which writes to translated code are detected
+	enum { CODE_PAGE_BITS = 8 };
+
+	struct Edge {
+		MXOcta Target;
+
+		// Module cell holding the successor entry, null while unlinked and
+		// once the IR is released
+		llvm::GlobalVariable* Link;
+
+		VerticeEntry* Cell;
+	};
+
+	typedef std::vector<Edge> EdgeList;
+
+	struct CacheSlot {
+		MXOcta Xref;
+
+		VerticeEntry Entry;
+	};
+
+	struct InlineCache {
+		// Module array of CacheSlot, most recently patched first
+		llvm::GlobalVariable* Slots;
+
+		CacheSlot* Cells;
+	};
+
+	typedef std::vector<InlineCache> InlineCacheList;
+
+	// Host code offset at which each debug line starts, with the line
+	typedef std::vector<std::pair<MXTetra, MXTetra> > FaultMap;
 
 	struct Vertice {
 		EdgeList EdgeList;
 
-		void (*Entry)(MXOcta* a,MXOcta* b);
+		InlineCacheList InlineCaches;
+
+		VerticeEntry Entry;
 
 		llvm::Function* Function;
+
+		// 0 for quick unoptimized code, 1 once recompiled at OptLevel
+		unsigned Tier;
+
+		// Entry counter of tier 0 code, null when it is not profiled
+		llvm::GlobalVariable* Counter;
+
+		uint64_t* ExecCount;
+
+		// Dispatcher epoch of the last entry, null when the code cache is
+		// unbounded
+		llvm::GlobalVariable* LastUseCell;
+
+		uint64_t* LastUse;
+
+		// Compile unit whose engine owns the code
+		unsigned Unit;
+
+		uint64_t CodeBytes;
+
+		// IR left behind once the body is released
+		uint64_t IrBytes;
+
+		// Host side records, link cells and cache slots
+		uint64_t MetadataBytes;
+
+		// Guest code pages the region was translated from
+		std::vector<MXOcta> CodePages;
+
+		// Filled in by codegen; not persisted
+		FaultMap FaultMap;
 	};
 
+	// Guest instruction words regions are formed from. Compile workers only
+	// ever read these, copied from guest memory on the guest thread.
+	struct CodeSnapshot {
+		// Unmapped words read as 0, TRAP 0,0,0
+		boost::unordered_map<MXOcta, MXTetra> Words;
+
+		// Addresses a region may statically exit to, by the start of every
+		// region whose words are all in Words. Found by decoding alone, so
+		// they are there with chaining off as well.
+		boost::unordered_map<MXOcta, std::vector<MXOcta> > Regions;
+	};
+
+	// Copies the words of the region at xPtr into out unless they are there
+	// already; returns its exits.
+	const std::vector<MXOcta>& snapshotRegion(MmixLlvm::Engine& e, const JitCfg& cfg, MXOcta xPtr,
+		CodeSnapshot& out);
+
+	// The region at xPtr must be in code.
 	void emitSimpleVertice(llvm::LLVMContext& ctx, llvm::Module& m, 
-		MmixLlvm::Engine& e, MXOcta xPtr, Vertice& out);
+		const CodeSnapshot& code, const JitCfg& cfg, unsigned tier, MXOcta xPtr, Vertice& out);
+
+	// Guest instruction behind the host code at offset in the vertice
+	// translated from xPtr. Every guest instruction is emitted under a debug
+	// line holding its distance from xPtr; xPtr itself when nothing matches.
+	MXOcta getFaultingXPtr(const Vertice& v, MXOcta xPtr, size_t offset);
+
+	// Identifies the code emitSimpleVertice would produce: the guest
+	// instructions it covers, the settings it depends on and the versions,
+	// runtimeHash among them for the helper library inlined into it.
+	uint64_t hashVerticeSource(const CodeSnapshot& code, const JitCfg& cfg, unsigned tier, uint64_t runtimeHash, MXOcta xPtr);
+
+	// 64 bit hash of size bytes at data, mixed the way hashVerticeSource
+	// mixes its parts
+	uint64_t hashBytes(const void* data, size_t size);
+
+	// Writes the module of a single vertice as bitcode, the vertice itself
+	// recorded in named metadata so that it survives the round trip.
+	void writeVerticeBitcode(llvm::Module& m, const Vertice& v, llvm::raw_ostream& os);
+
+	// Rebuilds a vertice from a module read back and drops the metadata,
+	// false when the module carries none.
+	bool detachVerticeInfo(llvm::Module& m, Vertice& out);
 };
\ No newline at end of file
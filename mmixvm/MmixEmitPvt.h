@@ -32,6 +32,12 @@ namespace MmixLlvm {
 
 		extern void emitLeaveVerticeViaJump(VerticeContext& vctx, llvm::IRBuilder<>& builder, MXOcta target);
 
+		extern void emitPollPreempt(VerticeContext& vctx, llvm::IRBuilder<>& builder, MXOcta target);
+
+		extern void emitSaveRegister(VerticeContext& vctx, llvm::IRBuilder<>& builder, MXByte reg);
+
+		extern void emitSaveSpRegister(VerticeContext& vctx, llvm::IRBuilder<>& builder, MmixLlvm::SpecialReg sreg);
+
 		extern void emitLeaveVerticeViaIndirectJump(VerticeContext& vctx, llvm::IRBuilder<>& builder, llvm::Value* target);
 
 		extern void emitPushRegsAndLeaveVerticeViaJump(VerticeContext&vctx, MXByte xarg, llvm::IRBuilder<>& builder, MXOcta target);
@@ -232,6 +238,8 @@ namespace MmixLlvm {
 
 		extern void emitTrap(VerticeContext& vctx, llvm::IRBuilder<>& builder, MXByte xarg, MXByte yarg, MXByte zarg);
 
+		extern void emitSyncid(VerticeContext& vctx, llvm::IRBuilder<>& builder, MXByte xarg, MXByte yarg, MXByte zarg, bool immediate);
+
 		extern void emitGeta(VerticeContext& vctx, llvm::IRBuilder<>& builder, MXByte xarg, MXWyde yzarg, bool backward);
 
 		extern void emitJmp(VerticeContext& vctx, llvm::IRBuilder<>& builder, MXTetra xyzarg, bool backward);
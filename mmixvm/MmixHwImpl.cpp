@@ -1,11 +1,15 @@
 #include "stdafx.h"
 #include "Util.h"
 #include "MmixHwImpl.h"
+#include "runtime/MmixRuntime.h"
+#include <intrin.h>
+#include <tmmintrin.h>
 
 using llvm::Module;
 using llvm::Type;
 using llvm::PointerType;
 using llvm::ArrayType;
+using llvm::StructType;
 using llvm::FunctionType;
 using llvm::GlobalVariable;
 using llvm::GlobalValue;
@@ -13,11 +17,25 @@ using llvm::GenericValue;
 using llvm::ArrayRef;
 using llvm::Function;
 using llvm::EngineBuilder;
+using llvm::FunctionPassManager;
+using llvm::JITEventListener;
+using llvm::TimeRecord;
+using llvm::ValueToValueMapTy;
+using llvm::cast;
 using llvm::outs;
 
 using MmixLlvm::OS;
 using MmixLlvm::MmixHwImpl;
 using MmixLlvm::HardwareCfg;
+using MmixLlvm::GuestMemory;
+using MmixLlvm::JitCfg;
+using MmixLlvm::JitStats;
+using MmixLlvm::Vertice;
+using MmixLlvm::VerticeEntry;
+using MmixLlvm::EdgeList;
+using MmixLlvm::CacheSlot;
+using MmixLlvm::FaultMap;
+using MmixLlvm::InlineCacheList;
 using MmixLlvm::MXByte;
 using MmixLlvm::MXWyde;
 using MmixLlvm::MXTetra;
@@ -25,8 +43,192 @@ using MmixLlvm::MXOcta;
 
 namespace {
 	enum { REGION_BIT_OFFSET = 61 };
+
+	// Speculative vertices kept waiting for the guest at most
+	enum { SPECULATIVE_LIMIT = 256 };
+
+	// Words in a block of host cells
+	enum { CELL_BLOCK_WORDS = 4096 };
 	const MXOcta TWO_ENABLED_BITS = 3LL;
-	const MXOcta ADDR_MASK = ~(TWO_ENABLED_BITS << REGION_BIT_OFFSET);
+
+	// Counts machine code and keeps the line table of the function emitted last
+	class CodeListener : public JITEventListener {
+		uint64_t& _bytes;
+
+		FaultMap& _faultMap;
+	public:
+		CodeListener(uint64_t& bytes, FaultMap& faultMap)
+			:_bytes(bytes)
+			,_faultMap(faultMap)
+		{}
+
+		virtual void NotifyFunctionEmitted(const Function& f, void* code, size_t size,
+			const EmittedFunctionDetails& details)
+		{
+			_bytes += size;
+			_faultMap.clear();
+			for (size_t i = 0; i < details.LineStarts.size(); i++) {
+				const EmittedFunctionDetails::LineStart& ls = details.LineStarts[i];
+				_faultMap.push_back(std::make_pair((MXTetra)(ls.Address - (uintptr_t)code), ls.Loc.getLine()));
+			}
+		}
+	};
+
+	// Rough heap footprint of a function body; LLVM has no exact figure
+	uint64_t estimateIrBytes(const Function& f) {
+		uint64_t bytes = sizeof(Function) + f.getName().size();
+		for (Function::const_iterator bb = f.begin(); bb != f.end(); ++bb) {
+			bytes += sizeof(llvm::BasicBlock) + bb->getName().size();
+			for (llvm::BasicBlock::const_iterator i = bb->begin(); i != bb->end(); ++i)
+				bytes += sizeof(llvm::Instruction) + i->getNumOperands() * sizeof(llvm::Use) + i->getName().size();
+		}
+		return bytes;
+	}
+
+	// Where the guard after a segment starts
+	size_t getSegmentLimit(size_t size) {
+		size_t chunkSize = (size_t)1 << GuestMemory::CHUNK_BITS;
+		return (size + chunkSize - 1) & ~(chunkSize - 1);
+	}
+
+	// Every segment sits at the start of a power of two sized slot and the rest
+	// of the slot, at least a chunk, is guard. Offsets are masked to the slot,
+	// so no guest address reaches past it.
+	size_t getSegmentStride(const HardwareCfg& hwCfg) {
+		size_t largest = std::max<size_t>(std::max<size_t>(hwCfg.TextSize, hwCfg.HeapSize), std::max<size_t>(hwCfg.PoolSize, hwCfg.StackSize));
+		size_t stride = (size_t)1 << GuestMemory::CHUNK_BITS;
+		while (stride <= getSegmentLimit(largest))
+			stride <<= 1;
+		return stride;
+	}
+
+	struct EntryCall {
+		VerticeEntry Entry;
+
+		MXOcta* InstrAddr;
+
+		MXOcta* TargetAddr;
+	};
+
+	uint64_t getMetadataBytes(const Vertice& v, size_t inlineCacheSize) {
+		return sizeof(Vertice)
+			+ v.EdgeList.capacity() * sizeof(MmixLlvm::Edge)
+			+ v.InlineCaches.capacity() * sizeof(MmixLlvm::InlineCache)
+			+ v.CodePages.capacity() * sizeof(MXOcta)
+			+ v.EdgeList.size() * sizeof(VerticeEntry)
+			+ v.InlineCaches.size() * inlineCacheSize * sizeof(CacheSlot)
+			+ v.FaultMap.size() * sizeof(FaultMap::value_type)
+			+ (v.ExecCount ? sizeof(uint64_t) : 0)
+			+ (v.LastUse ? sizeof(uint64_t) : 0);
+	}
+
+	// Erases what the code no longer references once bodies are gone: link
+	// cells, counters and runtime declarations, and functions not in keep.
+	void eraseUnused(Module& m, const boost::unordered_set<Function*>& keep) {
+		for (Module::global_iterator itr = m.global_begin(); itr != m.global_end(); ) {
+			GlobalVariable* gv = &*itr++;
+			gv->removeDeadConstantUsers();
+			if (gv->use_empty())
+				gv->eraseFromParent();
+		}
+		for (Module::iterator itr = m.begin(); itr != m.end(); ) {
+			Function* f = &*itr++;
+			f->removeDeadConstantUsers();
+			if (keep.find(f) == keep.end() && f->use_empty())
+				f->eraseFromParent();
+		}
+	}
+
+	typedef boost::unordered_multimap<MXOcta, VerticeEntry*> CellMap;
+
+	void eraseLink(CellMap& links, MXOcta target, VerticeEntry* cell) {
+		std::pair<CellMap::iterator, CellMap::iterator> range = links.equal_range(target);
+		for (CellMap::iterator itr = range.first; itr != range.second; ++itr) {
+			if (itr->second == cell) {
+				links.erase(itr);
+				return;
+			}
+		}
+	}
+
+	// Globals and functions an instruction refers to, through constant
+	// expressions as well
+	void collectGlobals(llvm::User* u, boost::unordered_set<GlobalValue*>& out) {
+		for (llvm::User::op_iterator op = u->op_begin(); op != u->op_end(); ++op) {
+			if (GlobalValue* gv = llvm::dyn_cast<GlobalValue>(*op))
+				out.insert(gv);
+			else if (llvm::Constant* c = llvm::dyn_cast<llvm::Constant>(*op))
+				collectGlobals(c, out);
+		}
+	}
+
+	template<class T> T* mapValue(ValueToValueMapTy& vmap, T* v) {
+		return v ? cast<T>((llvm::Value*)vmap[v]) : 0;
+	}
+
+	bool hasSsse3() {
+		int info[4];
+		__cpuid(info, 1);
+		return (info[2] & (1 << 9)) != 0;
+	}
+
+	// MOR and MXOR with pshufb, two of the eight rounds per register: the
+	// low half broadcasts y byte j to the lanes of the z bytes with bit j
+	// set, the high half does the same for bit j + 1. Out of line calls
+	// only, the bitcode inlined into optimized code keeps the scalar rounds
+	// of runtime/MmixRuntime.cpp since it must build without SSSE3.
+	uint64_t matrixSsse3(uint64_t y, uint64_t z, bool exclusive) {
+		__m128i ymm = _mm_loadl_epi64((const __m128i*)&y);
+		__m128i zmm = _mm_loadl_epi64((const __m128i*)&z);
+		zmm = _mm_unpacklo_epi64(zmm, zmm);
+		__m128i idx = _mm_setr_epi8(0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 1, 1, 1);
+		__m128i bit = _mm_setr_epi8(1, 1, 1, 1, 1, 1, 1, 1, 2, 2, 2, 2, 2, 2, 2, 2);
+		__m128i two = _mm_set1_epi8(2);
+		__m128i acc = _mm_setzero_si128();
+		for (int j = 0; j < 8; j += 2) {
+			__m128i sel = _mm_cmpeq_epi8(_mm_and_si128(zmm, bit), bit);
+			__m128i row = _mm_and_si128(_mm_shuffle_epi8(ymm, idx), sel);
+			acc = exclusive ? _mm_xor_si128(acc, row) : _mm_or_si128(acc, row);
+			idx = _mm_add_epi8(idx, two);
+			// Bytes never exceed 0x80, so the shift stays within them
+			bit = _mm_slli_epi16(bit, 2);
+		}
+		__m128i high = _mm_unpackhi_epi64(acc, acc);
+		acc = exclusive ? _mm_xor_si128(acc, high) : _mm_or_si128(acc, high);
+		uint64_t retVal;
+		_mm_storel_epi64((__m128i*)&retVal, acc);
+		return retVal;
+	}
+
+	uint64_t morSsse3(uint64_t y, uint64_t z) {
+		return matrixSsse3(y, z, false);
+	}
+
+	uint64_t mxorSsse3(uint64_t y, uint64_t z) {
+		return matrixSsse3(y, z, true);
+	}
+
+	// True when pc lies in the code of v, translated from xref; instrAddr is
+	// then the guest instruction it belongs to.
+	bool locateFault(const Vertice& v, MXOcta xref, const void* pc, MXOcta& instrAddr) {
+		const char* code = (const char*)v.Entry;
+		const char* pc0 = (const char*)pc;
+		if (pc0 < code || pc0 >= code + v.CodeBytes)
+			return false;
+		instrAddr = MmixLlvm::getFaultingXPtr(v, xref, pc0 - code);
+		return true;
+	}
+
+	llvm::CodeGenOpt::Level getCodeGenOptLevel(unsigned optLevel) {
+		switch (optLevel) {
+		case 0:
+			return llvm::CodeGenOpt::None;
+		case 1:
+			return llvm::CodeGenOpt::Less;
+		default:
+			return llvm::CodeGenOpt::Default;
+		}
+	}
 };
 
 enum {
@@ -34,176 +236,429 @@ enum {
 	SPECIAL_REGISTERS = 1 << 5,
 };
 
-MmixHwImpl::MmixHwImpl(const HardwareCfg& hwCfg, boost::shared_ptr<OS> os)
+MmixHwImpl::MmixHwImpl(const HardwareCfg& hwCfg, const JitCfg& jitCfg, boost::shared_ptr<OS> os)
 	:_registers(GENERIC_REGISTERS)
 	,_spRegisters(SPECIAL_REGISTERS)
-	,_memory(hwCfg.TextSize + hwCfg.HeapSize + hwCfg.PoolSize + hwCfg.StackSize)
-	,_att(4)
+	,_memory(getSegmentStride(hwCfg) * 4)
+	,_att(8)
+	,_codePages((getSegmentStride(hwCfg) * 4) >> MmixLlvm::CODE_PAGE_BITS)
+	,_tcache((size_t)1 << jitCfg.TranslationCacheBits)
 	,_os(os)
+	,_compiledReady(0)
+	,_stopping(false)
+	,_jitCfg(jitCfg)
 	,_halted(false)
+	,_preempt(0)
+	,_stopped(false)
 {
-	_att[0] = 0;
-	_att[1] = hwCfg.TextSize;
-	_att[2] = hwCfg.TextSize + hwCfg.HeapSize;
-	_att[3] = hwCfg.TextSize + hwCfg.HeapSize + hwCfg.PoolSize;
+	resetStats();
+	_hotVertice = ~0ULL;
+	_codeCacheEpoch = 0;
+	_cachedCodeBytes = 0;
+	_cellBlockUsed = 0;
+	_codeGeneration = 0;
+	flushTranslationCache();
+	size_t stride = getSegmentStride(hwCfg);
+	_jitCfg.SegmentOffsetMask = stride - 1;
+	size_t sizes[] = { hwCfg.TextSize, hwCfg.HeapSize, hwCfg.PoolSize, hwCfg.StackSize };
+	for (size_t i = 0; i < 4; i++) {
+		_att[2 * i] = i * stride;
+		_att[2 * i + 1] = getSegmentLimit(sizes[i]);
+		_memory.protect(i * stride + sizes[i], stride - sizes[i]);
+	}
 }
 
-void MmixHwImpl::postInit()
+void MmixHwImpl::resetStats() {
+	_stats.ChainedExits = 0;
+	_stats.UnchainedExits = 0;
+	_stats.TranslationCacheHits = 0;
+	_stats.TranslationCacheMisses = 0;
+	_stats.InlineCacheHits = 0;
+	_stats.InlineCacheMisses = 0;
+	_stats.ReturnPredictionHits = 0;
+	_stats.ReturnPredictionMisses = 0;
+	_stats.CompiledVertices = 0;
+	_stats.IrInstructions = 0;
+	_stats.NativeCodeBytes = 0;
+	_stats.IrBytes = 0;
+	_stats.RetainedIrBytes = 0;
+	_stats.MetadataBytes = 0;
+	_stats.CompileMicroseconds = 0;
+	_stats.TierUps = 0;
+	_stats.InterpretedBlocks = 0;
+	_stats.SpeculativeCompiles = 0;
+	_stats.SpeculativeUsed = 0;
+	_stats.SpeculativeWasted = 0;
+	_stats.Evictions = 0;
+	_stats.Recompiles = 0;
+	_stats.Invalidations = 0;
+	_stats.PersistentCacheHits = 0;
+	_stats.PersistentCacheStores = 0;
+	_stats.AheadOfTimeVertices = 0;
+	_stats.ProtectionFaults = 0;
+}
+
+// The runtime is only declared: every job module resolves these names
+// against the symbol table built in postInit.
+void MmixHwImpl::declareRuntime(llvm::LLVMContext& ctx, Module& m)
 {
-	_module = new Module("mmixvm", _lctx);
-	GlobalVariable* registersGlob = new GlobalVariable(*_module,
-		ArrayType::get(Type::getInt64Ty(_lctx), GENERIC_REGISTERS),
+	GlobalVariable* registersGlob = new GlobalVariable(m,
+		ArrayType::get(Type::getInt64Ty(ctx), GENERIC_REGISTERS),
 		false,
-		GlobalValue::CommonLinkage,
+		GlobalValue::ExternalLinkage,
 		0,
 		"Registers");
 	registersGlob->setAlignment(8);
 
-	GlobalVariable* registerStackBaseGlob = new GlobalVariable(*_module,
-		PointerType::get(Type::getInt64Ty(_lctx), 0),
+	GlobalVariable* registerStackBaseGlob = new GlobalVariable(m,
+		PointerType::get(Type::getInt64Ty(ctx), 0),
 		false,
-		GlobalValue::CommonLinkage,
+		GlobalValue::ExternalLinkage,
 		0,
 		"RegisterStackBase");
 	registerStackBaseGlob->setAlignment(8);
 
 
-	GlobalVariable* registerStackTopGlob = new GlobalVariable(*_module,
-		PointerType::get(Type::getInt64Ty(_lctx), 0),
+	GlobalVariable* registerStackTopGlob = new GlobalVariable(m,
+		PointerType::get(Type::getInt64Ty(ctx), 0),
 		false,
-		GlobalValue::CommonLinkage,
+		GlobalValue::ExternalLinkage,
 		0,
 		"RegisterStackTop");
 	registerStackTopGlob->setAlignment(8);
 
-	GlobalVariable* specialRegistersGlob = new GlobalVariable(*_module,
-		ArrayType::get(Type::getInt64Ty(_lctx), SPECIAL_REGISTERS),
+	GlobalVariable* specialRegistersGlob = new GlobalVariable(m,
+		ArrayType::get(Type::getInt64Ty(ctx), SPECIAL_REGISTERS),
 		false,
-		GlobalValue::CommonLinkage,
+		GlobalValue::ExternalLinkage,
 		0,
 		"SpecialRegisters");
 	specialRegistersGlob->setAlignment(8);
 
-	GlobalVariable* memGlob = new GlobalVariable(*_module,
-		ArrayType::get(Type::getInt8Ty(_lctx), _memory.size()),
+	GlobalVariable* memGlob = new GlobalVariable(m,
+		ArrayType::get(Type::getInt8Ty(ctx), _memory.size()),
 		false,
-		GlobalValue::CommonLinkage,
+		GlobalValue::ExternalLinkage,
 		0,
 		"Memory");
 	memGlob->setAlignment(8);
 
-	GlobalVariable* addressTranslateTableGlob = new GlobalVariable(*_module,
-		ArrayType::get(Type::getInt32Ty(_lctx), 4),
+	GlobalVariable* addressTranslateTableGlob = new GlobalVariable(m,
+		ArrayType::get(Type::getInt64Ty(ctx), _att.size()),
 		false,
-		GlobalValue::CommonLinkage,
+		GlobalValue::ExternalLinkage,
 		0,
 		"AddressTranslateTable");
 	addressTranslateTableGlob->setAlignment(8);
 
-	GlobalVariable* thisRef = new GlobalVariable(*_module, 
-		Type::getInt32PtrTy(_lctx),
+	new GlobalVariable(m,
+		Type::getInt32PtrTy(ctx),
 		false,
-		GlobalValue::CommonLinkage,
+		GlobalValue::ExternalLinkage,
 		0,
 		"ThisRef");
 
+	GlobalVariable* chainedExitsGlob = new GlobalVariable(m,
+		Type::getInt64Ty(ctx),
+		false,
+		GlobalValue::ExternalLinkage,
+		0,
+		"ChainedExits");
+	chainedExitsGlob->setAlignment(8);
+
+	GlobalVariable* unchainedExitsGlob = new GlobalVariable(m,
+		Type::getInt64Ty(ctx),
+		false,
+		GlobalValue::ExternalLinkage,
+		0,
+		"UnchainedExits");
+	unchainedExitsGlob->setAlignment(8);
+
+	GlobalVariable* hotVerticeGlob = new GlobalVariable(m,
+		Type::getInt64Ty(ctx),
+		false,
+		GlobalValue::ExternalLinkage,
+		0,
+		"HotVertice");
+	hotVerticeGlob->setAlignment(8);
+
+	GlobalVariable* epochGlob = new GlobalVariable(m,
+		Type::getInt64Ty(ctx),
+		false,
+		GlobalValue::ExternalLinkage,
+		0,
+		"CodeCacheEpoch");
+	epochGlob->setAlignment(8);
+
+	GlobalVariable* preemptGlob = new GlobalVariable(m,
+		Type::getInt32Ty(ctx),
+		false,
+		GlobalValue::ExternalLinkage,
+		0,
+		"Preempt");
+	preemptGlob->setAlignment(4);
+
+	GlobalVariable* tcacheHitsGlob = new GlobalVariable(m,
+		Type::getInt64Ty(ctx),
+		false,
+		GlobalValue::ExternalLinkage,
+		0,
+		"TranslationCacheHits");
+	tcacheHitsGlob->setAlignment(8);
+
+	GlobalVariable* icacheHitsGlob = new GlobalVariable(m,
+		Type::getInt64Ty(ctx),
+		false,
+		GlobalValue::ExternalLinkage,
+		0,
+		"InlineCacheHits");
+	icacheHitsGlob->setAlignment(8);
+
+	GlobalVariable* icacheMissesGlob = new GlobalVariable(m,
+		Type::getInt64Ty(ctx),
+		false,
+		GlobalValue::ExternalLinkage,
+		0,
+		"InlineCacheMisses");
+	icacheMissesGlob->setAlignment(8);
+
+	new GlobalVariable(m,
+		ArrayType::get(Type::getInt8Ty(ctx), _codePages.size()),
+		false,
+		GlobalValue::ExternalLinkage,
+		0,
+		"CodePages");
+
 	Type* params[5];
-	params[0] = Type::getInt64Ty(_lctx);
-	params[1] = Type::getInt64Ty(_lctx);
-	params[2] = Type::getInt64PtrTy(_lctx);
-	params[3] = Type::getInt64PtrTy(_lctx);
-	llvm::Function* muluImplF = llvm::Function::Create(
-		FunctionType::get(Type::getVoidTy(_lctx), ArrayRef<Type*>(params, params + 4), false), 
-		Function::ExternalLinkage, "MuluImpl", _module);
-
-	params[0] = Type::getInt64Ty(_lctx);
-	params[1] = Type::getInt64Ty(_lctx);
-	params[2] = Type::getInt64Ty(_lctx);
-	params[3] = Type::getInt64PtrTy(_lctx);
-	params[4] = Type::getInt64PtrTy(_lctx);
-	llvm::Function* divuImplF = llvm::Function::Create(
-		FunctionType::get(Type::getVoidTy(_lctx), ArrayRef<Type*>(params, params + 5), false), 
-		Function::ExternalLinkage, "DivuImpl", _module);
-
-	params[0] = Type::getInt64Ty(_lctx);
-	params[1] = Type::getInt64Ty(_lctx);
-	llvm::Function* morImplF = llvm::Function::Create(
-		FunctionType::get(Type::getInt64Ty(_lctx), ArrayRef<Type*>(params, params + 2), false), 
-		Function::ExternalLinkage, "MorImpl", _module);
-
-	params[0] = Type::getInt64Ty(_lctx);
-	params[1] = Type::getInt64Ty(_lctx);
-	llvm::Function* mxorImplF = llvm::Function::Create(
-		FunctionType::get(Type::getInt64Ty(_lctx), ArrayRef<Type*>(params, params + 2), false), 
-		Function::ExternalLinkage, "MxorImpl", _module);
-
-	params[0] = Type::getInt64Ty(_lctx);
-	llvm::Function* adjust64EndiannessImplF = llvm::Function::Create(
-		FunctionType::get(Type::getInt64Ty(_lctx), ArrayRef<Type*>(params, params + 1), false), 
-		Function::ExternalLinkage, "Adjust64EndiannessImpl", _module);
-
-	params[0] = Type::getInt32PtrTy(_lctx);
-	params[1] = Type::getInt64Ty(_lctx);
-	params[2] = Type::getInt64Ty(_lctx);
-	llvm::Function* trapHandlerF = llvm::Function::Create(
-		FunctionType::get(Type::getInt64Ty(_lctx), ArrayRef<Type*>(params, params + 3), false), 
-		Function::ExternalLinkage, "TrapHandler", _module);
-
-	/* static void pushRegStack0(void* handback, MXOcta count, MXOcta rL);*/
-	params[0] = Type::getInt32PtrTy(_lctx);
-	params[1] = Type::getInt64Ty(_lctx);
-	params[2] = Type::getInt64Ty(_lctx);
-	llvm::Function* pushRegStackImplF = llvm::Function::Create(
-		FunctionType::get(Type::getInt64Ty(_lctx), ArrayRef<Type*>(params, params + 3), false), 
-		Function::ExternalLinkage, "PushRegStack", _module);
-
-	/* static void popRegStack0(void* handback, MXOcta count, MXOcta* rL);*/
-	params[0] = Type::getInt32PtrTy(_lctx);
-	params[1] = Type::getInt64Ty(_lctx);
-	params[2] = Type::getInt64PtrTy(_lctx);
-	llvm::Function* popRegStackImplF = llvm::Function::Create(
-		FunctionType::get(Type::getInt64Ty(_lctx), ArrayRef<Type*>(params, params + 3), false), 
-		Function::ExternalLinkage, "PopRegStack", _module);
-
-	params[0] = Type::getInt32Ty(_lctx);
-	llvm::Function* debugInt32 = llvm::Function::Create(
-		FunctionType::get(Type::getVoidTy(_lctx), ArrayRef<Type*>(params, params + 1), false), 
-		Function::ExternalLinkage, "DebugInt32", _module);
-
-	params[0] = Type::getInt64Ty(_lctx);
-
-	llvm::Function* debugInt64 = llvm::Function::Create(
-		FunctionType::get(Type::getVoidTy(_lctx), ArrayRef<Type*>(params, params + 1), false), 
-		Function::ExternalLinkage, "DebugInt64", _module);
-
-	_ee.reset(EngineBuilder(_module).create());
-	_ee->addGlobalMapping(muluImplF, &MmixHwImpl::muluImpl);
-	_ee->addGlobalMapping(divuImplF, &MmixHwImpl::divuImpl);
-	_ee->addGlobalMapping(morImplF, &MmixHwImpl::morImpl);
-	_ee->addGlobalMapping(mxorImplF, &MmixHwImpl::mxorImpl);
-	_ee->addGlobalMapping(adjust64EndiannessImplF, &MmixHwImpl::adjust64EndiannessImpl);
-	_ee->addGlobalMapping(debugInt32, &MmixHwImpl::debugInt32);
-	_ee->addGlobalMapping(debugInt64, &MmixHwImpl::debugInt64);
-	_ee->addGlobalMapping(trapHandlerF, &MmixHwImpl::trapHandlerImpl);
-	_ee->addGlobalMapping(pushRegStackImplF, &MmixHwImpl::pushRegStack0);
-	_ee->addGlobalMapping(popRegStackImplF, &MmixHwImpl::popRegStack0);
-	_ee->addGlobalMapping(registersGlob, &_registers[0]);
-	_ee->addGlobalMapping(specialRegistersGlob, &_spRegisters[0]);
-	_ee->addGlobalMapping(memGlob, &_memory[0]);
-	_ee->addGlobalMapping(addressTranslateTableGlob, &_att[0]);
+	params[0] = Type::getInt64PtrTy(ctx);
+	params[1] = Type::getInt64PtrTy(ctx);
+	Type* verticeEntryTy = PointerType::get(
+		FunctionType::get(Type::getVoidTy(ctx), ArrayRef<Type*>(params, params + 2), false), 0);
+	params[0] = Type::getInt64Ty(ctx);
+	params[1] = verticeEntryTy;
+	GlobalVariable* tcacheGlob = new GlobalVariable(m,
+		ArrayType::get(StructType::get(ctx, ArrayRef<Type*>(params, params + 2)), _tcache.size()),
+		false,
+		GlobalValue::ExternalLinkage,
+		0,
+		"TranslationCache");
+	tcacheGlob->setAlignment(8);
+
+	params[0] = Type::getInt64Ty(ctx);
+	params[1] = Type::getInt64Ty(ctx);
+	params[2] = Type::getInt64Ty(ctx);
+	params[3] = Type::getInt64PtrTy(ctx);
+	params[4] = Type::getInt64PtrTy(ctx);
+	llvm::Function::Create(
+		FunctionType::get(Type::getVoidTy(ctx), ArrayRef<Type*>(params, params + 5), false), 
+		Function::ExternalLinkage, "DivuImpl", &m);
+
+	params[0] = Type::getInt64Ty(ctx);
+	params[1] = Type::getInt64Ty(ctx);
+	llvm::Function::Create(
+		FunctionType::get(Type::getInt64Ty(ctx), ArrayRef<Type*>(params, params + 2), false), 
+		Function::ExternalLinkage, "MorImpl", &m);
+
+	params[0] = Type::getInt64Ty(ctx);
+	params[1] = Type::getInt64Ty(ctx);
+	llvm::Function::Create(
+		FunctionType::get(Type::getInt64Ty(ctx), ArrayRef<Type*>(params, params + 2), false), 
+		Function::ExternalLinkage, "MxorImpl", &m);
+
+	params[0] = Type::getInt64Ty(ctx);
+	llvm::Function::Create(
+		FunctionType::get(Type::getInt64Ty(ctx), ArrayRef<Type*>(params, params + 1), false), 
+		Function::ExternalLinkage, "Adjust64EndiannessImpl", &m);
+
+	params[0] = Type::getInt32PtrTy(ctx);
+	params[1] = Type::getInt64Ty(ctx);
+	params[2] = Type::getInt64Ty(ctx);
+	llvm::Function::Create(
+		FunctionType::get(Type::getInt64Ty(ctx), ArrayRef<Type*>(params, params + 3), false), 
+		Function::ExternalLinkage, "TrapHandler", &m);
+
+	/* static void pushRegStack0(void* handback, MXOcta count, MXOcta rL, 
+		MXOcta returnXref, VerticeEntry* returnLink);*/
+	params[0] = Type::getInt32PtrTy(ctx);
+	params[1] = Type::getInt64Ty(ctx);
+	params[2] = Type::getInt64Ty(ctx);
+	params[3] = Type::getInt64Ty(ctx);
+	params[4] = PointerType::get(verticeEntryTy, 0);
+	llvm::Function::Create(
+		FunctionType::get(Type::getVoidTy(ctx), ArrayRef<Type*>(params, params + 5), false), 
+		Function::ExternalLinkage, "PushRegStack", &m);
+
+	/* static VerticeEntry popRegStack0(void* handback, MXOcta count, MXOcta* rL, MXOcta target);*/
+	params[0] = Type::getInt32PtrTy(ctx);
+	params[1] = Type::getInt64Ty(ctx);
+	params[2] = Type::getInt64PtrTy(ctx);
+	params[3] = Type::getInt64Ty(ctx);
+	llvm::Function::Create(
+		FunctionType::get(verticeEntryTy, ArrayRef<Type*>(params, params + 4), false), 
+		Function::ExternalLinkage, "PopRegStack", &m);
+
+	params[0] = Type::getInt32Ty(ctx);
+	llvm::Function::Create(
+		FunctionType::get(Type::getVoidTy(ctx), ArrayRef<Type*>(params, params + 1), false), 
+		Function::ExternalLinkage, "DebugInt32", &m);
+
+	params[0] = Type::getInt64Ty(ctx);
+
+	llvm::Function::Create(
+		FunctionType::get(Type::getVoidTy(ctx), ArrayRef<Type*>(params, params + 1), false), 
+		Function::ExternalLinkage, "DebugInt64", &m);
+
+	params[0] = Type::getInt32PtrTy(ctx);
+	params[1] = Type::getInt64Ty(ctx);
+	llvm::Function::Create(
+		FunctionType::get(Type::getVoidTy(ctx), ArrayRef<Type*>(params, params + 2), false), 
+		Function::ExternalLinkage, "CodeWritten", &m);
+
+	params[0] = Type::getInt32PtrTy(ctx);
+	params[1] = Type::getInt64Ty(ctx);
+	params[2] = Type::getInt64Ty(ctx);
+	llvm::Function::Create(
+		FunctionType::get(Type::getVoidTy(ctx), ArrayRef<Type*>(params, params + 3), false), 
+		Function::ExternalLinkage, "SyncId", &m);
+}
+
+void MmixHwImpl::initJitUnit(JitUnit& unit)
+{
+	unit.Ee.reset(EngineBuilder(new Module("mmixvm", unit.Lctx))
+		.setOptLevel(getCodeGenOptLevel(_jitCfg.OptLevel)).create());
+	if (baseTier() == 0) {
+		unit.Tier0Ee.reset(EngineBuilder(new Module("mmixvm", unit.Lctx))
+			.setOptLevel(llvm::CodeGenOpt::None).create());
+	}
+	if (_runtimeBitcode) {
+		std::string err;
+		unit.Runtime.reset(llvm::ParseBitcodeFile(_runtimeBitcode.get(), unit.Lctx, &err));
+		if (!unit.Runtime)
+			llvm::errs() << _jitCfg.RuntimeBitcode << ": " << err << '\n';
+	}
+	unit.CodeBytes = 0;
+	unit.CodeListener.reset(new CodeListener(unit.CodeBytes, unit.FaultMap));
+	unit.Ee->RegisterJITEventListener(unit.CodeListener.get());
+	if (unit.Tier0Ee)
+		unit.Tier0Ee->RegisterJITEventListener(unit.CodeListener.get());
+}
+
+// The legacy JIT fixes the codegen level per engine, so tier 0 has one of
+// its own.
+llvm::ExecutionEngine& MmixHwImpl::getEngine(JitUnit& unit, unsigned tier) {
+	return tier == 0 ? *unit.Tier0Ee : *unit.Ee;
+}
+
+// Binds the runtime declarations of a job module to their absolute addresses.
+void MmixHwImpl::mapRuntime(llvm::ExecutionEngine& ee, Module& m) {
+	for (Module::global_iterator itr = m.global_begin(); itr != m.global_end(); ++itr) {
+		SymbolMap::iterator sym = _runtimeSymbols.find(itr->getName().str());
+		if (itr->isDeclaration() && sym != _runtimeSymbols.end())
+			ee.addGlobalMapping(&*itr, sym->second);
+	}
+	for (Module::iterator itr = m.begin(); itr != m.end(); ++itr) {
+		SymbolMap::iterator sym = _runtimeSymbols.find(itr->getName().str());
+		if (itr->isDeclaration() && sym != _runtimeSymbols.end())
+			ee.addGlobalMapping(&*itr, sym->second);
+	}
+}
+
+// Links the helper library into a job module and inlines every call the
+// emitter made to it, ahead of the pass pipeline that folds them. A helper
+// the inliner declined is left a declaration and mapped like any other.
+void MmixHwImpl::inlineRuntime(JitUnit& unit, Module& m) {
+	std::string err;
+	if (llvm::Linker::LinkModules(&m, unit.Runtime.get(), llvm::Linker::PreserveSource, &err)) {
+		llvm::errs() << _jitCfg.RuntimeBitcode << ": " << err << '\n';
+		return;
+	}
+	std::vector<Function*> helpers;
+	for (Module::iterator itr = unit.Runtime->begin(); itr != unit.Runtime->end(); ++itr) {
+		Function* f = m.getFunction(itr->getName());
+		if (itr->isDeclaration() || !f || f->isDeclaration())
+			continue;
+		f->setLinkage(GlobalValue::InternalLinkage);
+		f->addFnAttr(llvm::Attribute::AlwaysInline);
+		helpers.push_back(f);
+	}
+	llvm::PassManager pm;
+	pm.add(new llvm::DataLayout(*unit.Ee->getDataLayout()));
+	pm.add(llvm::createAlwaysInlinerPass());
+	pm.run(m);
+	for (std::vector<Function*>::iterator itr = helpers.begin(); itr != helpers.end(); ++itr) {
+		if (!(*itr)->use_empty()) {
+			(*itr)->deleteBody();
+			(*itr)->removeFnAttr(llvm::Attribute::AlwaysInline);
+		} else {
+			(*itr)->eraseFromParent();
+		}
+	}
+}
+
+void MmixHwImpl::postInit()
+{
 	_handback[0] = this;
-	_ee->addGlobalMapping(thisRef, &_handback[0]);
 	_regStackTop[0] = &_registers[0];
-	_ee->addGlobalMapping(registerStackTopGlob, &_regStackTop[0]);
 	_regStackBase[0] = &_registers[0];
-	_ee->addGlobalMapping(registerStackBaseGlob, &_regStackBase[0]);
+	_runtimeSymbols["DivuImpl"] = (void*)&DivuImpl;
+	bool ssse3 = hasSsse3();
+	_runtimeSymbols["MorImpl"] = ssse3 ? (void*)&morSsse3 : (void*)&MorImpl;
+	_runtimeSymbols["MxorImpl"] = ssse3 ? (void*)&mxorSsse3 : (void*)&MxorImpl;
+	_runtimeSymbols["Adjust64EndiannessImpl"] = (void*)&Adjust64EndiannessImpl;
+	_runtimeSymbols["DebugInt32"] = (void*)&MmixHwImpl::debugInt32;
+	_runtimeSymbols["DebugInt64"] = (void*)&MmixHwImpl::debugInt64;
+	_runtimeSymbols["TrapHandler"] = (void*)&MmixHwImpl::trapHandlerImpl;
+	_runtimeSymbols["PushRegStack"] = (void*)&MmixHwImpl::pushRegStack0;
+	_runtimeSymbols["PopRegStack"] = (void*)&MmixHwImpl::popRegStack0;
+	_runtimeSymbols["Registers"] = &_registers[0];
+	_runtimeSymbols["SpecialRegisters"] = &_spRegisters[0];
+	_runtimeSymbols["Memory"] = _memory.base();
+	_runtimeSymbols["AddressTranslateTable"] = &_att[0];
+	_runtimeSymbols["ThisRef"] = &_handback[0];
+	_runtimeSymbols["RegisterStackTop"] = &_regStackTop[0];
+	_runtimeSymbols["RegisterStackBase"] = &_regStackBase[0];
+	_runtimeSymbols["ChainedExits"] = &_stats.ChainedExits;
+	_runtimeSymbols["UnchainedExits"] = &_stats.UnchainedExits;
+	_runtimeSymbols["HotVertice"] = &_hotVertice;
+	_runtimeSymbols["CodeCacheEpoch"] = &_codeCacheEpoch;
+	_runtimeSymbols["Preempt"] = (void*)&_preempt;
+	_runtimeSymbols["TranslationCacheHits"] = &_stats.TranslationCacheHits;
+	_runtimeSymbols["TranslationCache"] = &_tcache[0];
+	_runtimeSymbols["InlineCacheHits"] = &_stats.InlineCacheHits;
+	_runtimeSymbols["InlineCacheMisses"] = &_stats.InlineCacheMisses;
+	_runtimeSymbols["CodePages"] = _codePages.base();
+	_runtimeSymbols["CodeWritten"] = (void*)&MmixHwImpl::codeWritten0;
+	_runtimeSymbols["SyncId"] = (void*)&MmixHwImpl::syncId0;
+	_runtimeHash = 0;
+	if (!_jitCfg.RuntimeBitcode.empty()) {
+		if (llvm::MemoryBuffer::getFile(_jitCfg.RuntimeBitcode, _runtimeBitcode))
+			llvm::errs() << _jitCfg.RuntimeBitcode << ": not found, helpers are called out of line\n";
+		else
+			_runtimeHash = hashBytes(_runtimeBitcode->getBufferStart(), _runtimeBitcode->getBufferSize());
+	}
+	if (!_jitCfg.CacheDir.empty()) {
+		bool existed;
+		llvm::sys::fs::create_directories(_jitCfg.CacheDir, existed);
+	}
+	if (_jitCfg.CompileThreads > 0)
+		llvm::llvm_start_multithreaded();
+	for (unsigned i = 0; i <= _jitCfg.CompileThreads; i++) {
+		_units.push_back(boost::shared_ptr<JitUnit>(new JitUnit()));
+		_units.back()->Index = i;
+		initJitUnit(*_units.back());
+	}
+	for (unsigned i = 1; i < _units.size(); i++)
+		_workers.create_thread(boost::bind(&MmixHwImpl::compileWorker, this, _units[i].get()));
 }
 
+// mask is the unit size less one; in host byte order the unit is looked up
+// at its mirrored offset within the octabyte
 MXByte* MmixHwImpl::translateAddr(MXOcta addr, MXByte mask) {
 	MXOcta addr0 = addr & ~((MXOcta)mask);
-	size_t base = _att[(size_t)((addr0 >> 61) & 3)];
-	size_t offset = addr0 & ADDR_MASK;
-	return &_memory[base + offset];
+	if (_jitCfg.NativeByteOrder)
+		addr0 ^= 7 - mask;
+	size_t seg = (size_t)((addr0 >> REGION_BIT_OFFSET) & TWO_ENABLED_BITS);
+	return _memory.base() + (size_t)(_att[2 * seg] + (addr0 & _jitCfg.SegmentOffsetMask));
 }
 
 void MmixHwImpl::debugInt32(int arg) {
@@ -216,123 +671,1260 @@ void MmixHwImpl::debugInt64(int64_t arg) {
 	outs().flush();
 }
 
-namespace {
-	const mpz_class _64MAX("FFFFFFFFFFFFFFFF", 16);
-};
-
-void MmixHwImpl::muluImpl(MXOcta arg1, MXOcta arg2, MXOcta* hiProd, MXOcta* loProd) {
-	mpz_class arg1_ = (mpz_class((MXTetra)(arg1 >> 32)) << 32)
-					   | mpz_class((MXTetra)(arg1 & UINT32_MAX));
-	mpz_class arg2_ = (mpz_class((MXTetra)(arg2 >> 32)) << 32)
-					   | mpz_class((MXTetra)(arg2 & UINT32_MAX));
-	mpz_class prod_ = arg1_ * arg2_;
-	mpz_class hiProd_ = prod_ >> 64;
-	mpz_class loProd_ = prod_ & _64MAX;
-	*hiProd = hiProd_.get_ux();
-	*loProd = loProd_.get_ux();
-}
-
-void MmixHwImpl::divuImpl(MXOcta hidivident, MXOcta lodivident, MXOcta divisor, MXOcta* quotient, MXOcta* remainder) {
-	mpz_class divident_ = (mpz_class((MXTetra)(hidivident>>32)) << 96) 
-		                   | (mpz_class((MXTetra)(hidivident & UINT32_MAX)) << 64)
-					       | (mpz_class((MXTetra)(lodivident >> 32)) << 32)
-					       | mpz_class((MXTetra)(lodivident & UINT32_MAX));
-	mpz_class divisor_ = (mpz_class((MXTetra)(divisor >> 32)) << 32)
-					       | mpz_class((MXTetra)(divisor & UINT32_MAX));
-	mpz_class quotient_ = divident_ / divisor_;
-	mpz_class remainder_ = divident_ % divisor_;
-	*quotient = quotient_.get_ux();
-	*remainder = remainder_.get_ux();
-}
-
-MXOcta MmixHwImpl::adjust64EndiannessImpl(MXOcta arg) {
-	MXByte* ref = (MXByte*)&arg;
-	return  ((MXOcta)ref[0] << 56) | ((MXOcta)ref[1] << 48)
-	          | ((MXOcta)ref[2] << 40) | ((MXOcta)ref[3] << 32)
-		      | ((MXOcta)ref[4] << 24) | ((MXOcta)ref[5] << 16)
-	          | ((MXOcta)ref[6] << 8)  |  (MXOcta)ref[7];
-}
-
 MXOcta MmixHwImpl::trapHandlerImpl(void* handback, MXOcta instr, MXOcta vector) {
 	MmixHwImpl* this__ = static_cast<MmixHwImpl*>(handback);
 	return this__->_os->handleTrap(*this__, instr, vector);
 }
 
-void MmixHwImpl::pushRegStack0(void* handback, MXOcta count, MXOcta rL) {
-	static_cast<MmixHwImpl*>(handback)->pushRegStack(count, rL);
+void MmixHwImpl::pushRegStack0(void* handback, MXOcta count, MXOcta rL,
+	MXOcta returnXref, VerticeEntry* returnLink)
+{
+	static_cast<MmixHwImpl*>(handback)->pushRegStack(count, rL, returnXref, returnLink);
 }
 
-void MmixHwImpl::pushRegStack(MXOcta count, MXOcta rL) {
+void MmixHwImpl::pushRegStack(MXOcta count, MXOcta rL, MXOcta returnXref, VerticeEntry* returnLink) {
 	RegStackEntry e0;
 	e0.TopRef = _regStackTop[0];
 	e0.rL = rL;
-	_regStack.push(e0);
+	e0.ReturnXref = returnXref;
+	e0.ReturnLink = returnLink;
+	_regStack.push_back(e0);
 	_regStackTop[0] += count;
 }
 
-void MmixHwImpl::popRegStack0(void* handback, MXOcta count, MXOcta* rL) {
-	static_cast<MmixHwImpl*>(handback)->popRegStack(count, rL);
+VerticeEntry MmixHwImpl::popRegStack0(void* handback, MXOcta count, MXOcta* rL, MXOcta target) {
+	return static_cast<MmixHwImpl*>(handback)->popRegStack(count, rL, target);
 }
 
-void MmixHwImpl::popRegStack(MXOcta count, MXOcta* rL) {
-	RegStackEntry e0 = _regStack.top();
+VerticeEntry MmixHwImpl::popRegStack(MXOcta count, MXOcta* rL, MXOcta target) {
+	RegStackEntry e0 = _regStack.back();
 	*rL = e0.rL + count;
 	_regStackTop[0] = e0.TopRef;
-	_regStack.pop();
+	_regStack.pop_back();
+	// The caller's continuation is only predicted for a plain POP to rJ whose
+	// vertice has already been compiled and linked.
+	if (e0.ReturnLink != 0 && e0.ReturnXref == target && *e0.ReturnLink != 0) {
+		_stats.ReturnPredictionHits++;
+		return *e0.ReturnLink;
+	}
+	_stats.ReturnPredictionMisses++;
+	return 0;
 }
 
-MXOcta MmixHwImpl::morImpl(MXOcta y, MXOcta z) {
-	MXOcta retVal = 0LL;
-	for (int i = 0; i < 8; i++) {
-		MXByte b = (MXByte)((z >> (i << 3)) & 0xFF);
-		for (int j = 0; j < 8; j++) {
-			if ((b & (1 << j)) != 0)
-				retVal |= ((y >> (j << 3)) & 0xFF) << (i << 3);
+
+
+boost::shared_ptr<MmixHwImpl> MmixHwImpl::create(const HardwareCfg& hwCfg, const JitCfg& jitCfg,
+	boost::shared_ptr<OS> os)
+{
+	boost::shared_ptr<MmixHwImpl> retVal(new MmixHwImpl(hwCfg, jitCfg, os));
+	retVal->postInit();
+	return retVal;
+}
+
+FunctionPassManager* MmixHwImpl::createPassPipeline(JitUnit& unit, Module* m) {
+	if (_jitCfg.OptLevel == 0)
+		return 0;
+	FunctionPassManager* fpm = new FunctionPassManager(m);
+	fpm->add(new llvm::DataLayout(*unit.Ee->getDataLayout()));
+	fpm->add(llvm::createBasicAliasAnalysisPass());
+	fpm->add(llvm::createPromoteMemoryToRegisterPass());
+	fpm->add(llvm::createInstructionCombiningPass());
+	fpm->add(llvm::createCFGSimplificationPass());
+	if (_jitCfg.OptLevel >= 2) {
+		fpm->add(llvm::createGVNPass());
+		fpm->add(llvm::createDeadStoreEliminationPass());
+		fpm->add(llvm::createInstructionCombiningPass());
+		fpm->add(llvm::createCFGSimplificationPass());
+	}
+	fpm->doInitialization();
+	return fpm;
+}
+
+const JitStats& MmixHwImpl::getStats() const {
+	return _stats;
+}
+
+unsigned MmixHwImpl::baseTier() const {
+	return _jitCfg.TierUpThreshold > 0 ? 0 : 1;
+}
+
+// Claims an address for compilation; false when it is already queued or in
+// flight at that tier.
+bool MmixHwImpl::claimCompile(MXOcta xref, unsigned tier) {
+	boost::lock_guard<boost::mutex> lock(_compileLock);
+	return _compileKeys.insert(CompileKey(xref, tier)).second;
+}
+
+// Worth compiling along with a job on the guest thread: not compiled yet,
+// and warm in the interpreter unless that is off. Blocks reaching the full
+// threshold queue jobs of their own, so half of it is enough. Ahead of
+// time, all text is.
+bool MmixHwImpl::isBatchable(MXOcta xref, bool ahead) {
+	if (_vertices.find(xref) != _vertices.end() || _speculative.find(xref) != _speculative.end())
+		return false;
+	if (ahead)
+		return isText(xref);
+	if (_jitCfg.InterpThreshold == 0)
+		return isMapped(xref);
+	InterpBlockMap::const_iterator ib = _interpBlocks.find(xref);
+	return ib != _interpBlocks.end() && ib->second.ExecCount >= (_jitCfg.InterpThreshold + 1) / 2;
+}
+
+// Runs on the guest thread before a job is queued for a worker. Besides the
+// job's own code it reads ahead, breadth first through static exits, the
+// batchable regions the job may take along. Their pages are held as code
+// until the job is done, so that a store to them before the job is published
+// makes it stale.
+void MmixHwImpl::snapshotJob(CompileJob& job) {
+	job.Generation = _codeGeneration;
+	std::vector<MXOcta> pending(snapshotRegion(*this, _jitCfg, job.Xref, job.Code));
+	for (std::vector<MXOcta>::iterator itr = job.Batch.begin(); itr != job.Batch.end(); ++itr) {
+		const std::vector<MXOcta>& exits = snapshotRegion(*this, _jitCfg, *itr, job.Code);
+		pending.insert(pending.end(), exits.begin(), exits.end());
+	}
+	size_t budget = job.Tier == baseTier() && !job.Speculative ? std::max<size_t>(_jitCfg.BatchBudget, 1) : 1;
+	for (size_t i = 0; i < pending.size() && job.Code.Regions.size() < budget; i++) {
+		if (job.Code.Regions.find(pending[i]) != job.Code.Regions.end() || !isBatchable(pending[i], false))
+			continue;
+		const std::vector<MXOcta>& exits = snapshotRegion(*this, _jitCfg, pending[i], job.Code);
+		pending.insert(pending.end(), exits.begin(), exits.end());
+	}
+	boost::unordered_set<size_t> pages;
+	for (boost::unordered_map<MXOcta, MXTetra>::iterator itr = job.Code.Words.begin(); itr != job.Code.Words.end(); ++itr) {
+		size_t page = getCodePage(itr->first);
+		if (page < _codePages.size() && pages.insert(page).second)
+			holdCodePage(page);
+	}
+	job.Pages.assign(pages.begin(), pages.end());
+}
+
+// Runs on the guest thread or a compile worker: everything it touches
+// belongs to the unit, and the results are only published by the guest.
+// Workers never read guest memory, only the snapshot the job was queued
+// with; on the guest thread the snapshot is filled in as needed.
+// A base tier job also takes along, through the static exits of what it has
+// emitted so far, up to BatchBudget vertices nobody has claimed yet: on a
+// worker those snapshotted with it, on the guest thread those isBatchable
+// accepts. All of them are emitted into a module of the job's own and go
+// through the pass pipeline there; codegen is still one getPointerToFunction
+// per vertice. Vertices found in the persistent cache come in modules of
+// their own and skip emission and the pass pipeline, though not codegen: the
+// cache holds optimized IR, since the legacy JIT has no way to load
+// relocatable machine code.
+void MmixHwImpl::translateJob(JitUnit& unit, CompileJob& job, std::vector<CompileResult>& out) {
+	double start = TimeRecord::getCurrentTime(true).getWallTime();
+	bool onGuest = unit.Index == 0;
+	long generation = job.Generation;
+	Module* m = new Module("job", unit.Lctx);
+	declareRuntime(unit.Lctx, *m);
+	std::vector<Module*> modules(1, m);
+	size_t first = out.size();
+	size_t budget = job.Ahead ? std::max<size_t>(_jitCfg.AotBudget, 1)
+		: job.Tier == baseTier() && !job.Speculative ? std::max<size_t>(_jitCfg.BatchBudget, 1) : 1;
+	out.push_back(CompileResult());
+	out.back().Xref = job.Xref;
+	for (std::vector<MXOcta>::const_iterator itr = job.Batch.begin(); itr != job.Batch.end(); ++itr) {
+		out.push_back(CompileResult());
+		out.back().Xref = *itr;
+	}
+	for (size_t i = first; i < out.size(); i++) {
+		out[i].Speculative = job.Speculative;
+		out[i].Generation = generation;
+		out[i].Cached = false;
+		out[i].Stored = false;
+		Module* cached = 0;
+		const std::vector<MXOcta>& exits = onGuest ? snapshotRegion(*this, _jitCfg, out[i].Xref, job.Code)
+			: job.Code.Regions.find(out[i].Xref)->second;
+		if (!_jitCfg.CacheDir.empty()) {
+			out[i].CacheKey = hashVerticeSource(job.Code, _jitCfg, job.Tier, _runtimeHash, out[i].Xref);
+			cached = loadCachedVertice(unit, out[i].CacheKey, out[i].Compiled);
+		}
+		if (cached) {
+			modules.push_back(cached);
+			out[i].Cached = true;
+		} else {
+			emitSimpleVertice(unit.Lctx, *m, job.Code, _jitCfg, job.Tier, out[i].Xref, out[i].Compiled);
+		}
+		for (size_t e = 0; e < exits.size() && out.size() - first < budget; e++) {
+			MXOcta target = exits[e];
+			bool wanted = onGuest ? isBatchable(target, job.Ahead)
+				: job.Code.Regions.find(target) != job.Code.Regions.end();
+			if (wanted && claimCompile(target, job.Tier)) {
+				out.push_back(CompileResult());
+				out.back().Xref = target;
+			}
 		}
 	}
-    return retVal;
+	boost::scoped_ptr<FunctionPassManager> fpm(job.Tier > 0 ? createPassPipeline(unit, m) : 0);
+	if (fpm && unit.Runtime)
+		inlineRuntime(unit, *m);
+	llvm::ExecutionEngine& ee = getEngine(unit, job.Tier);
+	for (std::vector<Module*>::iterator itr = modules.begin(); itr != modules.end(); ++itr) {
+		ee.addModule(*itr);
+		mapRuntime(ee, **itr);
+	}
+	// Codegen rewrites the IR, so everything is stored before any of it runs
+	for (size_t i = first; i < out.size(); i++) {
+		CompileResult& r = out[i];
+		Vertice& v = r.Compiled;
+		r.IrBytes = estimateIrBytes(*v.Function);
+		if (fpm && !r.Cached)
+			fpm->run(*v.Function);
+		r.IrInstructions = 0;
+		for (Function::iterator itr = v.Function->begin(); itr != v.Function->end(); ++itr)
+			r.IrInstructions += itr->size();
+		if (!r.Cached && !_jitCfg.CacheDir.empty())
+			r.Stored = storeCachedVertice(*m, v, r.CacheKey);
+	}
+	for (size_t i = first; i < out.size(); i++) {
+		CompileResult& r = out[i];
+		Vertice& v = r.Compiled;
+		uint64_t codeBytes = unit.CodeBytes;
+		mapCells(ee, v);
+		v.Entry = (VerticeEntry)ee.getPointerToFunction(v.Function);
+		v.FaultMap.swap(unit.FaultMap);
+		v.Unit = unit.Index;
+		v.CodeBytes = unit.CodeBytes - codeBytes;
+		r.CompileMicroseconds = 0;
+	}
+	releaseIr(modules, out, first);
+	// All of the job may have come from the cache
+	if (m->empty() && m->global_empty()) {
+		ee.removeModule(m);
+		delete m;
+	}
+	// The whole batch is charged to the vertice that caused it
+	out[first].CompileMicroseconds = (uint64_t)((TimeRecord::getCurrentTime(true).getWallTime() - start) * 1e6);
 }
 
-MXOcta MmixHwImpl::mxorImpl(MXOcta y, MXOcta z) {
-	MXOcta retVal = 0LL;
-	for (int i = 0; i < 8; i++) {
-		MXByte b = (MXByte)((z >> (i << 3)) & 0xFF);
-		for (int j = 0; j < 8; j++) {
-			if ((b & (1 << j)) != 0)
-				retVal ^= ((y >> (j << 3)) & 0xFF) << (i << 3);
+// Only the machine code outlives the job. Bodies are deleted and so is every
+// global the code was linked against, now that their addresses are resolved.
+// The vertice functions stay behind as bare declarations because erasing a
+// function makes the JIT free its code too; the module goes with the last.
+void MmixHwImpl::releaseIr(const std::vector<Module*>& modules, std::vector<CompileResult>& out, size_t first) {
+	boost::unordered_set<Function*> keep;
+	for (size_t i = first; i < out.size(); i++) {
+		Vertice& v = out[i].Compiled;
+		v.Function->deleteBody();
+		keep.insert(v.Function);
+		v.Counter = 0;
+		v.LastUseCell = 0;
+		for (EdgeList::iterator itr = v.EdgeList.begin(); itr != v.EdgeList.end(); ++itr)
+			itr->Link = 0;
+		for (InlineCacheList::iterator itr = v.InlineCaches.begin(); itr != v.InlineCaches.end(); ++itr)
+			itr->Slots = 0;
+		v.IrBytes = estimateIrBytes(*v.Function);
+		v.MetadataBytes = getMetadataBytes(v, _jitCfg.InlineCacheSize);
+	}
+	for (std::vector<Module*>::const_iterator itr = modules.begin(); itr != modules.end(); ++itr)
+		eraseUnused(**itr, keep);
+}
+
+std::string MmixHwImpl::getCachePath(uint64_t key) const {
+	llvm::SmallString<128> path(_jitCfg.CacheDir);
+	llvm::sys::path::append(path, llvm::utohexstr(key) + ".bc");
+	return path.str();
+}
+
+// A missing, unreadable or foreign file is just a miss.
+Module* MmixHwImpl::loadCachedVertice(JitUnit& unit, uint64_t key, Vertice& out) {
+	llvm::OwningPtr<llvm::MemoryBuffer> buf;
+	if (llvm::MemoryBuffer::getFile(getCachePath(key), buf))
+		return 0;
+	std::string err;
+	Module* m = llvm::ParseBitcodeFile(buf.get(), unit.Lctx, &err);
+	if (m && !detachVerticeInfo(*m, out)) {
+		delete m;
+		m = 0;
+	}
+	return m;
+}
+
+// Every file holds a single vertice and the globals and runtime declarations
+// it uses, cloned into a module of its own; the rest of the batch is never
+// copied. The file is written under a unique name and renamed into place:
+// concurrent runs sharing the directory never read a partial file.
+bool MmixHwImpl::storeCachedVertice(Module& m, const Vertice& v, uint64_t key) {
+	boost::scoped_ptr<Module> copy(new Module("vertice", m.getContext()));
+	copy->setDataLayout(m.getDataLayout());
+	copy->setTargetTriple(m.getTargetTriple());
+	boost::unordered_set<GlobalValue*> used;
+	for (Function::iterator bb = v.Function->begin(); bb != v.Function->end(); ++bb)
+		for (llvm::BasicBlock::iterator inst = bb->begin(); inst != bb->end(); ++inst)
+			collectGlobals(&*inst, used);
+	// The cells go along even if optimization dropped every use
+	if (v.Counter)
+		used.insert(v.Counter);
+	if (v.LastUseCell)
+		used.insert(v.LastUseCell);
+	for (EdgeList::const_iterator itr = v.EdgeList.begin(); itr != v.EdgeList.end(); ++itr)
+		used.insert(itr->Link);
+	for (InlineCacheList::const_iterator itr = v.InlineCaches.begin(); itr != v.InlineCaches.end(); ++itr)
+		used.insert(itr->Slots);
+	ValueToValueMapTy vmap;
+	for (boost::unordered_set<GlobalValue*>::iterator itr = used.begin(); itr != used.end(); ++itr) {
+		if (GlobalVariable* gv = llvm::dyn_cast<GlobalVariable>(*itr)) {
+			GlobalVariable* gv0 = new GlobalVariable(*copy, gv->getType()->getElementType(), gv->isConstant(),
+				gv->getLinkage(), gv->hasInitializer() ? gv->getInitializer() : 0, gv->getName());
+			gv0->setAlignment(gv->getAlignment());
+			vmap[gv] = gv0;
+		} else {
+			// Runtime helpers, bodiless by now
+			Function* f = cast<Function>(*itr);
+			Function* f0 = Function::Create(f->getFunctionType(), f->getLinkage(), f->getName(), copy.get());
+			f0->copyAttributesFrom(f);
+			vmap[f] = f0;
+		}
+	}
+	Function* f0 = Function::Create(v.Function->getFunctionType(), v.Function->getLinkage(),
+		v.Function->getName(), copy.get());
+	f0->copyAttributesFrom(v.Function);
+	Function::arg_iterator arg0 = f0->arg_begin();
+	for (Function::arg_iterator arg = v.Function->arg_begin(); arg != v.Function->arg_end(); ++arg, ++arg0) {
+		arg0->setName(arg->getName());
+		vmap[&*arg] = &*arg0;
+	}
+	llvm::SmallVector<llvm::ReturnInst*, 8> returns;
+	llvm::CloneFunctionInto(f0, v.Function, vmap, true, returns);
+	Vertice v0 = v;
+	v0.Function = mapValue(vmap, v.Function);
+	v0.Counter = mapValue(vmap, v.Counter);
+	v0.LastUseCell = mapValue(vmap, v.LastUseCell);
+	for (EdgeList::iterator itr = v0.EdgeList.begin(); itr != v0.EdgeList.end(); ++itr)
+		itr->Link = mapValue(vmap, itr->Link);
+	for (InlineCacheList::iterator itr = v0.InlineCaches.begin(); itr != v0.InlineCaches.end(); ++itr)
+		itr->Slots = mapValue(vmap, itr->Slots);
+	std::string path = getCachePath(key);
+	llvm::SmallString<128> tmpPath;
+	int fd;
+	if (llvm::sys::fs::unique_file(path + "-%%%%%%%%", fd, tmpPath))
+		return false;
+	{
+		// Only the name is needed, the file is reopened in binary mode
+		llvm::raw_fd_ostream reserved(fd, true);
+	}
+	std::string err;
+	bool failed;
+	{
+		llvm::raw_fd_ostream os(tmpPath.c_str(), err, llvm::raw_fd_ostream::F_Binary);
+		failed = !err.empty();
+		if (!failed) {
+			writeVerticeBitcode(*copy, v0, os);
+			os.close();
+			failed = os.has_error();
+			os.clear_error();
+		}
+	}
+	if (failed || llvm::sys::fs::rename(tmpPath.str(), path)) {
+		bool existed;
+		llvm::sys::fs::remove(tmpPath.str(), existed);
+		return false;
+	}
+	return true;
+}
+
+// Publication happens on the guest thread between two vertice runs, so the
+// map, link cells and caches never change under running code. A result for
+// a vertice already present at the same or a higher tier is dropped, and so
+// is one translated from a page invalidated since its job read it.
+void MmixHwImpl::publishVertice(CompileResult& r) {
+	{
+		boost::lock_guard<boost::mutex> lock(_compileLock);
+		_compileKeys.erase(CompileKey(r.Xref, r.Compiled.Tier));
+	}
+	if (readStaleCode(r)) {
+		if (r.Speculative)
+			_stats.SpeculativeWasted++;
+		else
+			rearmCompile(r.Xref, r.Compiled.Tier);
+		freeVertice(r.Compiled);
+		return;
+	}
+	_stats.CompiledVertices++;
+	_stats.IrInstructions += r.IrInstructions;
+	_stats.NativeCodeBytes += r.Compiled.CodeBytes;
+	_stats.IrBytes += r.IrBytes;
+	_stats.RetainedIrBytes += r.Compiled.IrBytes;
+	_stats.MetadataBytes += r.Compiled.MetadataBytes;
+	_stats.CompileMicroseconds += r.CompileMicroseconds;
+	if (r.Cached)
+		_stats.PersistentCacheHits++;
+	if (r.Stored)
+		_stats.PersistentCacheStores++;
+	VerticeMap::iterator itr = _vertices.find(r.Xref);
+	if (r.Speculative) {
+		_stats.SpeculativeCompiles++;
+		if (itr == _vertices.end() && _speculative.size() < SPECULATIVE_LIMIT
+			&& _speculative.insert(VerticeMap::value_type(r.Xref, r.Compiled)).second)
+		{
+			addCodePages(r.Xref, r.Compiled);
+			return;
+		}
+		_stats.SpeculativeWasted++;
+		freeVertice(r.Compiled);
+	} else if (itr == _vertices.end()) {
+		VerticeMap::iterator spec = _speculative.find(r.Xref);
+		if (spec != _speculative.end()) {
+			removeCodePages(r.Xref, spec->second);
+			freeVertice(spec->second);
+			_speculative.erase(spec);
+			_stats.SpeculativeWasted++;
 		}
+		Vertice& v = _vertices[r.Xref] = r.Compiled;
+		addCodePages(r.Xref, v);
+		useVertice(r.Xref, v);
+		linkVertice(r.Xref, v);
+		speculateSuccessors(v);
+	} else if (r.Compiled.Tier > itr->second.Tier) {
+		// The old code may still be running further up, so it is retired rather
+		// than freed: its cells stay known to unlinkAll until freeRetired, and
+		// everything pointing at its entry is redirected.
+		Vertice& v = itr->second;
+		VerticeEntry oldEntry = v.Entry;
+		RetiredVertice retired = { _codeCacheEpoch, r.Xref, v };
+		_retired.push_back(retired);
+		removeCodePages(r.Xref, v);
+		v = r.Compiled;
+		addCodePages(r.Xref, v);
+		useVertice(r.Xref, v);
+		linkVertice(r.Xref, v);
+		redirectEntry(r.Xref, oldEntry, v.Entry);
+		_stats.TierUps++;
+	} else {
+		freeVertice(r.Compiled);
 	}
-    return retVal;
 }
 
+bool MmixHwImpl::readStaleCode(const CompileResult& r) {
+	if (r.Generation == _codeGeneration)
+		return false;
+	const std::vector<MXOcta>& pages = r.Compiled.CodePages;
+	for (std::vector<MXOcta>::const_iterator itr = pages.begin(); itr != pages.end(); ++itr) {
+		boost::unordered_map<size_t, long>::iterator gen = _pageGenerations.find(getCodePage(*itr));
+		if (gen != _pageGenerations.end() && gen->second > r.Generation)
+			return true;
+	}
+	return false;
+}
 
-boost::shared_ptr<MmixHwImpl> MmixHwImpl::create(const HardwareCfg& hwCfg, boost::shared_ptr<OS> os)
-{
-	boost::shared_ptr<MmixHwImpl> retVal(new MmixHwImpl(hwCfg, os));
-	retVal->postInit();
-	return retVal;
+// The interpreter queues a block and tier 0 code asks for its tier up only
+// once, when their counts reach the threshold, so a dropped result has the
+// count start over. compileVertice asks again by itself.
+void MmixHwImpl::rearmCompile(MXOcta xref, unsigned tier) {
+	if (tier == baseTier()) {
+		InterpBlockMap::iterator ib = _interpBlocks.find(xref);
+		if (ib != _interpBlocks.end())
+			ib->second.ExecCount = 0;
+		return;
+	}
+	VerticeMap::iterator itr = _vertices.find(xref);
+	if (itr != _vertices.end() && itr->second.Tier < tier && itr->second.ExecCount)
+		*itr->second.ExecCount = 0;
+}
+
+// Urgent jobs are the ones the guest waits for and jump the queue.
+void MmixHwImpl::requestCompile(MXOcta xref, unsigned tier, bool urgent, bool speculative) {
+	CompileJob job;
+	job.Xref = xref;
+	job.Tier = tier;
+	job.Speculative = speculative;
+	job.Ahead = false;
+	bool queued;
+	{
+		boost::lock_guard<boost::mutex> lock(_compileLock);
+		queued = !_compileKeys.insert(CompileKey(xref, tier)).second;
+		if (queued) {
+			if (!urgent)
+				return;
+			std::deque<CompileJob>::iterator itr = _compileQueue.begin();
+			while (itr != _compileQueue.end() && (itr->Xref != xref || itr->Tier != tier))
+				++itr;
+			// Already with a worker or in another job's batch
+			if (itr == _compileQueue.end())
+				return;
+			// Moved up front with the code it was queued with
+			job = *itr;
+			_compileQueue.erase(itr);
+			_compileQueue.push_front(job);
+		}
+	}
+	if (!queued) {
+		// Read outside the lock; the address is claimed already
+		snapshotJob(job);
+		boost::lock_guard<boost::mutex> lock(_compileLock);
+		if (urgent)
+			_compileQueue.push_front(job);
+		else
+			_compileQueue.push_back(job);
+	}
+	_compileQueued.notify_one();
+}
+
+// Job pages are released last, so that a page the published code covers
+// stays flagged throughout.
+void MmixHwImpl::publishCompiled() {
+	std::vector<CompileResult> done;
+	std::vector<size_t> pages;
+	{
+		boost::lock_guard<boost::mutex> lock(_compileLock);
+		done.swap(_compiled);
+		pages.swap(_releasedPages);
+		_compiledReady = 0;
+	}
+	for (std::vector<CompileResult>::iterator itr = done.begin(); itr != done.end(); ++itr)
+		publishVertice(*itr);
+	for (std::vector<size_t>::iterator itr = pages.begin(); itr != pages.end(); ++itr)
+		releaseCodePage(*itr);
+}
+
+void MmixHwImpl::compileWorker(JitUnit* unit) {
+	std::vector<Function*> doomed;
+	for (;;) {
+		CompileJob job;
+		{
+			boost::unique_lock<boost::mutex> lock(_compileLock);
+			while (_compileQueue.empty() && !_stopping)
+				_compileQueued.wait(lock);
+			if (_stopping)
+				return;
+			job = _compileQueue.front();
+			_compileQueue.pop_front();
+			doomed.swap(unit->Doomed);
+		}
+		for (std::vector<Function*>::iterator itr = doomed.begin(); itr != doomed.end(); ++itr)
+			eraseVerticeFunction(*unit, *itr);
+		doomed.clear();
+		std::vector<CompileResult> results;
+		translateJob(*unit, job, results);
+		{
+			boost::lock_guard<boost::mutex> lock(_compileLock);
+			_compiled.insert(_compiled.end(), results.begin(), results.end());
+			_releasedPages.insert(_releasedPages.end(), job.Pages.begin(), job.Pages.end());
+			_compiledReady = 1;
+		}
+		_compileDone.notify_all();
+	}
+}
+
+// The guest only ever blocks here, on the vertice it is about to run.
+Vertice& MmixHwImpl::compileVertice(MXOcta xref) {
+	if (_jitCfg.CompileThreads == 0) {
+		compileOnGuest(xref, baseTier(), false);
+		return _vertices[xref];
+	}
+	VerticeMap::iterator itr;
+	while ((itr = findVertice(xref)) == _vertices.end()) {
+		// Asked for every round, in case the result was dropped as stale
+		requestCompile(xref, baseTier(), true, false);
+		{
+			boost::unique_lock<boost::mutex> lock(_compileLock);
+			while (_compiled.empty())
+				_compileDone.wait(lock);
+		}
+		publishCompiled();
+	}
+	return itr->second;
+}
+
+// Successors are the vertice exits: fall-through, JMP and branch targets
+// outside the region, taken and probable branches alike. Only vertices the
+// guest actually runs are speculated from, so lookahead stays one deep.
+void MmixHwImpl::speculateSuccessors(const Vertice& v) {
+	if (!_jitCfg.EnableSpeculation || _jitCfg.CompileThreads == 0)
+		return;
+	for (EdgeList::const_iterator e = v.EdgeList.begin(); e != v.EdgeList.end() && _speculative.size() < SPECULATIVE_LIMIT; ++e)
+		if (_vertices.find(e->Target) == _vertices.end() && _speculative.find(e->Target) == _speculative.end())
+			requestCompile(e->Target, baseTier(), false, true);
+}
+
+// A speculative vertice enters the map and gets linked the first time the
+// guest asks for it.
+MmixHwImpl::VerticeMap::iterator MmixHwImpl::findVertice(MXOcta xref) {
+	VerticeMap::iterator itr = _vertices.find(xref);
+	if (itr != _vertices.end())
+		return itr;
+	VerticeMap::iterator spec = _speculative.find(xref);
+	if (spec == _speculative.end())
+		return itr;
+	Vertice& v = _vertices[xref] = spec->second;
+	_speculative.erase(spec);
+	_stats.SpeculativeUsed++;
+	useVertice(xref, v);
+	linkVertice(xref, v);
+	speculateSuccessors(v);
+	return _vertices.find(xref);
+}
+
+// Recompiles a hot vertice together with its warm static successors, all in
+// one job. With compile workers the tier 0 code keeps running until the
+// replacements are published.
+void MmixHwImpl::tierUp(MXOcta xref) {
+	VerticeMap::iterator itr = _vertices.find(xref);
+	if (itr == _vertices.end() || itr->second.Tier > 0 || !claimCompile(xref, 1))
+		return;
+	CompileJob job;
+	job.Xref = xref;
+	job.Tier = 1;
+	job.Speculative = false;
+	job.Ahead = false;
+	job.Generation = _codeGeneration;
+	EdgeList& edges = itr->second.EdgeList;
+	for (EdgeList::iterator e = edges.begin(); e != edges.end(); ++e) {
+		VerticeMap::iterator succ = _vertices.find(e->Target);
+		if (succ != _vertices.end() && succ->second.Tier == 0 && succ->second.ExecCount != 0
+			&& *succ->second.ExecCount >= _jitCfg.TierUpThreshold / 2
+			&& claimCompile(e->Target, 1))
+			job.Batch.push_back(e->Target);
+	}
+	if (_jitCfg.CompileThreads == 0) {
+		translateOnGuest(job);
+		return;
+	}
+	snapshotJob(job);
+	{
+		boost::lock_guard<boost::mutex> lock(_compileLock);
+		_compileQueue.push_back(job);
+	}
+	_compileQueued.notify_one();
+}
+
+void MmixHwImpl::compileOnGuest(MXOcta xref, unsigned tier, bool ahead) {
+	CompileJob job;
+	job.Xref = xref;
+	job.Tier = tier;
+	job.Speculative = false;
+	job.Ahead = ahead;
+	job.Generation = _codeGeneration;
+	claimCompile(xref, tier);
+	translateOnGuest(job);
+}
+
+void MmixHwImpl::translateOnGuest(CompileJob& job) {
+	std::vector<CompileResult> results;
+	translateJob(*_units[0], job, results);
+	for (std::vector<CompileResult>::iterator itr = results.begin(); itr != results.end(); ++itr)
+		publishVertice(*itr);
+}
+
+// The whole program as far as static exits tell goes into one module at
+// OptLevel, so it never needs tiering up. GO, PUSHGO and POP targets are
+// found by the dispatcher as usual and compiled on demand.
+void MmixHwImpl::compileAhead(MXOcta xref) {
+	_os->getTextSections(_textSections);
+	std::sort(_textSections.begin(), _textSections.end());
+	if (!isText(xref))
+		return;
+	uint64_t compiled = _stats.CompiledVertices;
+	compileOnGuest(xref, 1, true);
+	_stats.AheadOfTimeVertices += _stats.CompiledVertices - compiled;
+}
+
+// Sections are sorted by start, so only the last one starting at or before
+// xref can hold it.
+bool MmixHwImpl::isText(MXOcta xref) const {
+	std::vector<std::pair<MXOcta, MXOcta> >::const_iterator itr = std::upper_bound(
+		_textSections.begin(), _textSections.end(), std::make_pair(xref, ~0ULL));
+	return itr != _textSections.begin() && xref < (itr - 1)->second;
+}
+
+// Accounts a vertice entering the map; until it runs it counts as used now.
+void MmixHwImpl::useVertice(MXOcta xref, Vertice& v) {
+	_cachedCodeBytes += v.CodeBytes;
+	if (v.LastUse) {
+		*v.LastUse = _codeCacheEpoch;
+		_coldVertices.push(UseStamp(_codeCacheEpoch, xref));
+		// Entries left by discarded vertices pile up without eviction
+		if (_coldVertices.size() > 2 * _vertices.size() + SPECULATIVE_LIMIT) {
+			std::vector<UseStamp> live;
+			for (VerticeMap::iterator itr = _vertices.begin(); itr != _vertices.end(); ++itr)
+				if (itr->second.LastUse)
+					live.push_back(UseStamp(*itr->second.LastUse, itr->first));
+			_coldVertices = UseHeap(std::greater<UseStamp>(), live);
+		}
+	}
+	if (_evicted.erase(xref) > 0)
+		_stats.Recompiles++;
+}
+
+// Evicts least recently entered vertices until the cache is back to three
+// quarters of its limit, so the next few compiles do not evict again. An
+// entry whose vertice has been entered since it was pushed goes back with
+// the newer stamp.
+void MmixHwImpl::evictColdVertices() {
+	uint64_t target = _jitCfg.CodeCacheBytes / 4 * 3;
+	uint64_t remaining = _cachedCodeBytes;
+	boost::unordered_set<MXOcta> chosen;
+	std::vector<MXOcta> victims;
+	while (!_coldVertices.empty() && remaining > target) {
+		UseStamp top = _coldVertices.top();
+		_coldVertices.pop();
+		VerticeMap::iterator itr = _vertices.find(top.second);
+		if (itr == _vertices.end() || !itr->second.LastUse || chosen.find(top.second) != chosen.end())
+			continue;
+		if (*itr->second.LastUse > top.first) {
+			_coldVertices.push(UseStamp(*itr->second.LastUse, top.second));
+			continue;
+		}
+		chosen.insert(top.second);
+		victims.push_back(top.second);
+		remaining -= itr->second.CodeBytes;
+	}
+	discardVertices(victims);
+	_evicted.insert(victims.begin(), victims.end());
+	_stats.Evictions += victims.size();
+}
+
+// Only called from the dispatcher, when no vertice code is running. Every
+// link cell, cache slot and return link that could still reach the code is
+// cleared first: link cells through the index of those pointing at each
+// victim, inline caches, which the code patches itself, in one pass for the
+// whole lot.
+void MmixHwImpl::discardVertices(const std::vector<MXOcta>& victims) {
+	if (victims.empty())
+		return;
+	detachVertices(victims);
+	for (std::vector<MXOcta>::const_iterator itr = victims.begin(); itr != victims.end(); ++itr) {
+		VerticeMap::iterator victim = _vertices.find(*itr);
+		Vertice& v = victim->second;
+		dropCells(v);
+		// Evicted code is cold: profile it again before recompiling
+		InterpBlockMap::iterator ib = _interpBlocks.find(*itr);
+		if (ib != _interpBlocks.end())
+			ib->second.ExecCount = 0;
+		_cachedCodeBytes -= v.CodeBytes;
+		removeCodePages(*itr, v);
+		freeVertice(v);
+		_vertices.erase(victim);
+	}
+}
+
+// Makes the vertices at xrefs unreachable from other code: links to them are
+// broken and left pending, cache entries for them cleared. Nothing is freed,
+// so this is safe to do from within vertice code.
+void MmixHwImpl::detachVertices(const std::vector<MXOcta>& xrefs) {
+	for (std::vector<MXOcta>::const_iterator itr = xrefs.begin(); itr != xrefs.end(); ++itr) {
+		unlinkTarget(*itr);
+		CacheSlot& tc = probeTranslationCache(*itr);
+		if (tc.Xref == *itr) {
+			tc.Xref = ~0ULL;
+			tc.Entry = 0;
+		}
+	}
+	if (_jitCfg.InlineCacheSize > 0 && !xrefs.empty()) {
+		boost::unordered_set<MXOcta> targets(xrefs.begin(), xrefs.end());
+		for (VerticeMap::iterator itr = _vertices.begin(); itr != _vertices.end(); ++itr)
+			clearInlineCaches(itr->second, targets);
+		for (size_t i = 0; i < _retired.size(); i++)
+			clearInlineCaches(_retired[i].Code, targets);
+	}
+}
+
+// The link cells of a vertice about to be freed are zeroed and forgotten.
+void MmixHwImpl::dropCells(Vertice& v) {
+	for (EdgeList::iterator e = v.EdgeList.begin(); e != v.EdgeList.end(); ++e) {
+		*e->Cell = 0;
+		eraseLink(_pendingLinks, e->Target, e->Cell);
+		eraseLink(_linkCells, e->Target, e->Cell);
+	}
+}
+
+// Called by the dispatcher after bumping the epoch. The guest thread does not
+// reenter it, so every vertice run of an earlier dispatch has returned and
+// code retired back then is unreachable.
+void MmixHwImpl::freeRetired() {
+	std::vector<RetiredVertice> kept;
+	for (size_t i = 0; i < _retired.size(); i++) {
+		Vertice& v = _retired[i].Code;
+		if (_retired[i].Epoch < _codeCacheEpoch) {
+			dropCells(v);
+			_cachedCodeBytes -= v.CodeBytes;
+			freeVertice(v);
+		} else {
+			kept.push_back(_retired[i]);
+		}
+	}
+	_retired.swap(kept);
+}
+
+size_t MmixHwImpl::getCodePage(MXOcta xref) {
+	return (size_t)(translateAddr(xref, 0) - _memory.base()) >> MmixLlvm::CODE_PAGE_BITS;
+}
+
+// The vertice at xref is indexed under every page it was translated from.
+void MmixHwImpl::addCodePages(MXOcta xref, const Vertice& v) {
+	for (std::vector<MXOcta>::const_iterator itr = v.CodePages.begin(); itr != v.CodePages.end(); ++itr) {
+		size_t page = getCodePage(*itr);
+		CodePageMap::iterator refs = _codePageRefs.find(page);
+		if (refs == _codePageRefs.end()) {
+			refs = _codePageRefs.insert(CodePageMap::value_type(page, CodePageRefs())).first;
+			refs->second.Readers = 0;
+		}
+		refs->second.Vertices.push_back(xref);
+		_codePages.base()[page] = 1;
+	}
+}
+
+void MmixHwImpl::removeCodePages(MXOcta xref, const Vertice& v) {
+	for (std::vector<MXOcta>::const_iterator itr = v.CodePages.begin(); itr != v.CodePages.end(); ++itr) {
+		size_t page = getCodePage(*itr);
+		CodePageMap::iterator refs = _codePageRefs.find(page);
+		std::vector<MXOcta>& vertices = refs->second.Vertices;
+		vertices.erase(std::find(vertices.begin(), vertices.end(), xref));
+		if (vertices.empty() && refs->second.Readers == 0) {
+			_codePageRefs.erase(refs);
+			_codePages.base()[page] = 0;
+		}
+	}
+}
+
+void MmixHwImpl::holdCodePage(size_t page) {
+	CodePageMap::iterator refs = _codePageRefs.find(page);
+	if (refs == _codePageRefs.end()) {
+		refs = _codePageRefs.insert(CodePageMap::value_type(page, CodePageRefs())).first;
+		refs->second.Readers = 0;
+	}
+	refs->second.Readers++;
+	_codePages.base()[page] = 1;
+}
+
+void MmixHwImpl::releaseCodePage(size_t page) {
+	CodePageMap::iterator refs = _codePageRefs.find(page);
+	if (--refs->second.Readers == 0 && refs->second.Vertices.empty()) {
+		_codePageRefs.erase(refs);
+		_codePages.base()[page] = 0;
+	}
+}
+
+// Every page of the words in [begin, end) once; the words are mapped.
+void MmixHwImpl::holdCodePages(MXOcta begin, MXOcta end) {
+	size_t last = ~(size_t)0;
+	for (MXOcta xref = begin; xref < end; xref += sizeof(MXTetra)) {
+		size_t page = getCodePage(xref);
+		if (page != last)
+			holdCodePage(page);
+		last = page;
+	}
+}
+
+void MmixHwImpl::releaseCodePages(MXOcta begin, MXOcta end) {
+	size_t last = ~(size_t)0;
+	for (MXOcta xref = begin; xref < end; xref += sizeof(MXTetra)) {
+		size_t page = getCodePage(xref);
+		if (page != last)
+			releaseCodePage(page);
+		last = page;
+	}
+}
+
+void MmixHwImpl::codeWritten0(void* handback, MXOcta xref) {
+	static_cast<MmixHwImpl*>(handback)->codeWritten(xref);
+}
+
+// May run inside vertice code, so nothing is freed here. Only the vertices
+// translated from the page are detached, so the running code can no longer
+// reach them and gets to the dispatcher instead, which drops them; the page
+// flag is cleared so that further stores to it stay cheap until then.
+void MmixHwImpl::codeWritten(MXOcta xref) {
+	size_t page = getCodePage(xref);
+	if (page >= _codePages.size())
+		return;
+	_dirtyCodePages.push_back(page);
+	if (!_codePages.base()[page])
+		return;
+	_codePages.base()[page] = 0;
+	// A flagged page always has its entry
+	detachVertices(_codePageRefs.find(page)->second.Vertices);
+}
+
+void MmixHwImpl::syncId0(void* handback, MXOcta xref, MXOcta count) {
+	static_cast<MmixHwImpl*>(handback)->syncId(xref, count);
+}
+
+// Also records pages without code yet, so that a compile job that may have
+// read them before the write is dropped. The range is inclusive and may run
+// up to the top of the address space.
+void MmixHwImpl::syncId(MXOcta xref, MXOcta count) {
+	MXOcta first = xref >> MmixLlvm::CODE_PAGE_BITS;
+	MXOcta last = (count > ~xref ? ~0ULL : xref + count) >> MmixLlvm::CODE_PAGE_BITS;
+	for (MXOcta page = 0; page <= last - first; page++)
+		codeWritten((first + page) << MmixLlvm::CODE_PAGE_BITS);
+}
+
+void MmixHwImpl::noteWrite(MXOcta xref) {
+	size_t page = getCodePage(xref);
+	if (page < _codePages.size() && _codePages.base()[page])
+		codeWritten(xref);
+}
+
+// Drops every vertice and decoded block translated from a dirty page. They
+// are translated again from the new code the next time the guest gets there.
+void MmixHwImpl::invalidateDirtyCode() {
+	boost::unordered_set<size_t> dirty(_dirtyCodePages.begin(), _dirtyCodePages.end());
+	_dirtyCodePages.clear();
+	_codeGeneration++;
+	boost::unordered_set<MXOcta> covering;
+	for (boost::unordered_set<size_t>::iterator itr = dirty.begin(); itr != dirty.end(); ++itr) {
+		_pageGenerations[*itr] = _codeGeneration;
+		CodePageMap::iterator refs = _codePageRefs.find(*itr);
+		if (refs != _codePageRefs.end())
+			covering.insert(refs->second.Vertices.begin(), refs->second.Vertices.end());
+	}
+	std::vector<MXOcta> victims;
+	for (boost::unordered_set<MXOcta>::iterator itr = covering.begin(); itr != covering.end(); ++itr) {
+		VerticeMap::iterator spec = _speculative.find(*itr);
+		if (spec != _speculative.end()) {
+			removeCodePages(*itr, spec->second);
+			freeVertice(spec->second);
+			_speculative.erase(spec);
+			_stats.SpeculativeWasted++;
+		} else {
+			victims.push_back(*itr);
+		}
+	}
+	discardVertices(victims);
+	_stats.Invalidations += covering.size();
+	for (InterpBlockMap::iterator itr = _interpBlocks.begin(); itr != _interpBlocks.end(); ) {
+		bool stale = false;
+		for (MXOcta xref = itr->first; xref < itr->second.Next && !stale; xref += sizeof(MXTetra))
+			stale = dirty.find(getCodePage(xref)) != dirty.end();
+		if (stale) {
+			releaseCodePages(itr->first, itr->second.Next);
+			itr = _interpBlocks.erase(itr);
+		} else {
+			++itr;
+		}
+	}
+	relinkPending();
+}
+
+void MmixHwImpl::unlinkTarget(MXOcta xref) {
+	std::pair<LinkMap::iterator, LinkMap::iterator> cells = _linkCells.equal_range(xref);
+	for (LinkMap::iterator itr = cells.first; itr != cells.second; ++itr) {
+		if (*itr->second != 0) {
+			*itr->second = 0;
+			_pendingLinks.insert(LinkMap::value_type(xref, itr->second));
+		}
+	}
+}
+
+void MmixHwImpl::clearInlineCaches(Vertice& v, const boost::unordered_set<MXOcta>& targets) {
+	for (InlineCacheList::iterator ic = v.InlineCaches.begin(); ic != v.InlineCaches.end(); ++ic) {
+		for (size_t i = 0; i < _jitCfg.InlineCacheSize; i++) {
+			if (targets.find(ic->Cells[i].Xref) != targets.end()) {
+				ic->Cells[i].Xref = ~0ULL;
+				ic->Cells[i].Entry = 0;
+			}
+		}
+	}
+}
+
+uint64_t* MmixHwImpl::allocCell(size_t words) {
+	boost::lock_guard<boost::mutex> lock(_cellLock);
+	std::vector<uint64_t*>& free = _freeCells[words];
+	if (!free.empty()) {
+		uint64_t* cell = free.back();
+		free.pop_back();
+		return cell;
+	}
+	if (_cellBlocks.empty() || _cellBlockUsed + words > CELL_BLOCK_WORDS) {
+		_cellBlocks.push_back(boost::shared_array<uint64_t>(new uint64_t[std::max<size_t>(words, CELL_BLOCK_WORDS)]));
+		_cellBlockUsed = 0;
+	}
+	uint64_t* cell = _cellBlocks.back().get() + _cellBlockUsed;
+	_cellBlockUsed += words;
+	return cell;
+}
+
+// Runs before codegen: the JIT finds the cells of the vertice mapped and
+// emits no storage of its own for them.
+void MmixHwImpl::mapCells(llvm::ExecutionEngine& ee, Vertice& v) {
+	if (v.Counter) {
+		v.ExecCount = allocCell(1);
+		*v.ExecCount = 0;
+		ee.addGlobalMapping(v.Counter, v.ExecCount);
+	}
+	if (v.LastUseCell) {
+		v.LastUse = allocCell(1);
+		*v.LastUse = 0;
+		ee.addGlobalMapping(v.LastUseCell, v.LastUse);
+	}
+	for (EdgeList::iterator itr = v.EdgeList.begin(); itr != v.EdgeList.end(); ++itr) {
+		itr->Cell = (VerticeEntry*)allocCell(1);
+		*itr->Cell = 0;
+		ee.addGlobalMapping(itr->Link, itr->Cell);
+	}
+	size_t cacheWords = (_jitCfg.InlineCacheSize * sizeof(CacheSlot) + sizeof(uint64_t) - 1) / sizeof(uint64_t);
+	for (InlineCacheList::iterator itr = v.InlineCaches.begin(); itr != v.InlineCaches.end(); ++itr) {
+		itr->Cells = (CacheSlot*)allocCell(cacheWords);
+		for (size_t i = 0; i < _jitCfg.InlineCacheSize; i++) {
+			itr->Cells[i].Xref = ~0ULL;
+			itr->Cells[i].Entry = 0;
+		}
+		ee.addGlobalMapping(itr->Slots, itr->Cells);
+	}
+}
+
+// The next owner of a link cell stores its own successor, so a return link
+// still pointing at one would predict the wrong target; those are forgotten.
+void MmixHwImpl::releaseCells(Vertice& v) {
+	for (size_t i = 0; i < _regStack.size(); i++)
+		for (EdgeList::iterator e = v.EdgeList.begin(); e != v.EdgeList.end(); ++e)
+			if (_regStack[i].ReturnLink == e->Cell)
+				_regStack[i].ReturnLink = 0;
+	size_t cacheWords = (_jitCfg.InlineCacheSize * sizeof(CacheSlot) + sizeof(uint64_t) - 1) / sizeof(uint64_t);
+	boost::lock_guard<boost::mutex> lock(_cellLock);
+	if (v.ExecCount)
+		_freeCells[1].push_back(v.ExecCount);
+	if (v.LastUse)
+		_freeCells[1].push_back(v.LastUse);
+	for (EdgeList::iterator itr = v.EdgeList.begin(); itr != v.EdgeList.end(); ++itr)
+		_freeCells[1].push_back((uint64_t*)itr->Cell);
+	for (InlineCacheList::iterator itr = v.InlineCaches.begin(); itr != v.InlineCaches.end(); ++itr)
+		_freeCells[cacheWords].push_back((uint64_t*)itr->Cells);
+	v.ExecCount = 0;
+	v.LastUse = 0;
+	v.EdgeList.clear();
+	v.InlineCaches.clear();
+}
+
+// Erasing the function makes the JIT free its code. That has to happen on
+// the thread owning the unit, so workers pick their share up with their next
+// job. The cells go back to the pool right away.
+void MmixHwImpl::freeVertice(Vertice& v) {
+	releaseCells(v);
+	if (v.Unit == 0) {
+		eraseVerticeFunction(*_units[0], v.Function);
+		return;
+	}
+	boost::lock_guard<boost::mutex> lock(_compileLock);
+	_units[v.Unit]->Doomed.push_back(v.Function);
+}
+
+// After releaseIr a job module holds nothing but the declarations of its
+// vertices, so once the last of them is gone the module leaves the engine.
+void MmixHwImpl::eraseVerticeFunction(JitUnit& unit, Function* f) {
+	Module* m = f->getParent();
+	f->eraseFromParent();
+	if (!m->empty() || !m->global_empty() || !m->alias_empty())
+		return;
+	if (unit.Ee->removeModule(m) || (unit.Tier0Ee && unit.Tier0Ee->removeModule(m)))
+		delete m;
+}
+
+void MmixHwImpl::redirectEntry(MXOcta xref, VerticeEntry from, VerticeEntry to) {
+	for (VerticeMap::iterator itr = _vertices.begin(); itr != _vertices.end(); ++itr)
+		redirectCells(itr->second, xref, from, to);
+	for (size_t i = 0; i < _retired.size(); i++)
+		redirectCells(_retired[i].Code, xref, from, to);
+	CacheSlot& tc = probeTranslationCache(xref);
+	if (tc.Xref == xref)
+		tc.Entry = to;
+}
+
+void MmixHwImpl::redirectCells(Vertice& v, MXOcta xref, VerticeEntry from, VerticeEntry to) {
+	for (EdgeList::iterator e = v.EdgeList.begin(); e != v.EdgeList.end(); ++e)
+		if (e->Target == xref && *e->Cell == from)
+			*e->Cell = to;
+	for (InlineCacheList::iterator ic = v.InlineCaches.begin(); ic != v.InlineCaches.end(); ++ic)
+		for (size_t i = 0; i < _jitCfg.InlineCacheSize; i++)
+			if (ic->Cells[i].Xref == xref)
+				ic->Cells[i].Entry = to;
+}
+
+CacheSlot& MmixHwImpl::probeTranslationCache(MXOcta xref) {
+	return _tcache[(size_t)(xref >> 2) & (_tcache.size() - 1)];
+}
+
+void MmixHwImpl::flushTranslationCache() {
+	for (size_t i = 0; i < _tcache.size(); i++) {
+		// No vertice starts at an all-ones address, so stale tags never match
+		_tcache[i].Xref = ~0ULL;
+		_tcache[i].Entry = 0;
+	}
+}
+
+void MmixHwImpl::linkVertice(MXOcta xref, Vertice& v) {
+	for (EdgeList::iterator itr = v.EdgeList.begin(); itr != v.EdgeList.end(); ++itr) {
+		_linkCells.insert(LinkMap::value_type(itr->Target, itr->Cell));
+		VerticeMap::iterator target = _vertices.find(itr->Target);
+		if (target != _vertices.end())
+			*itr->Cell = target->second.Entry;
+		else
+			_pendingLinks.insert(LinkMap::value_type(itr->Target, itr->Cell));
+	}
+	std::pair<LinkMap::iterator, LinkMap::iterator> pending = _pendingLinks.equal_range(xref);
+	for (LinkMap::iterator itr = pending.first; itr != pending.second; ++itr)
+		*itr->second = v.Entry;
+	_pendingLinks.erase(pending.first, pending.second);
+}
+
+// Links whose target is back in the map after a mass unlink
+void MmixHwImpl::relinkPending() {
+	for (LinkMap::iterator itr = _pendingLinks.begin(); itr != _pendingLinks.end(); ) {
+		VerticeMap::iterator target = _vertices.find(itr->first);
+		if (target != _vertices.end()) {
+			*itr->second = target->second.Entry;
+			itr = _pendingLinks.erase(itr);
+		} else {
+			++itr;
+		}
+	}
+}
+
+void MmixHwImpl::unlinkAll() {
+	for (VerticeMap::iterator itr = _vertices.begin(); itr != _vertices.end(); ++itr)
+		unlinkVertice(itr->second);
+	for (size_t i = 0; i < _retired.size(); i++)
+		unlinkVertice(_retired[i].Code);
+}
+
+void MmixHwImpl::unlinkVertice(Vertice& v) {
+	for (EdgeList::iterator e = v.EdgeList.begin(); e != v.EdgeList.end(); ++e) {
+		if (*e->Cell != 0) {
+			_pendingLinks.insert(LinkMap::value_type(e->Target, e->Cell));
+			*e->Cell = 0;
+		}
+	}
+	for (InlineCacheList::iterator ic = v.InlineCaches.begin(); ic != v.InlineCaches.end(); ++ic) {
+		for (size_t i = 0; i < _jitCfg.InlineCacheSize; i++) {
+			ic->Cells[i].Xref = ~0ULL;
+			ic->Cells[i].Entry = 0;
+		}
+	}
 }
 
 void MmixHwImpl::run(MXOcta xref) {
+	load();
+	execute(xref);
+}
+
+MXOcta MmixHwImpl::load() {
+	_os->loadExecutable(*this);
+	MXOcta entry = _os->getEntryPoint();
+	if (_jitCfg.EnableAot)
+		compileAhead(entry);
+	return entry;
+}
+
+void MmixHwImpl::requestStop() {
+	_preempt = 1;
+}
+
+bool MmixHwImpl::wasStopped() const {
+	return _stopped;
+}
+
+// Registers and memory are saved as loaded; everything compiled stays valid
+// as long as the text is not written to.
+void MmixHwImpl::takeSnapshot() {
+	_snapshot.Registers = _registers;
+	_snapshot.SpRegisters = _spRegisters;
+	_memory.getCommitted(_snapshot.Chunks);
+	size_t chunkSize = (size_t)1 << GuestMemory::CHUNK_BITS;
+	_snapshot.Memory.resize(_snapshot.Chunks.size() * chunkSize);
+	for (size_t i = 0; i < _snapshot.Chunks.size(); i++)
+		memcpy(&_snapshot.Memory[i * chunkSize], _memory.base() + (_snapshot.Chunks[i] << GuestMemory::CHUNK_BITS), chunkSize);
+}
+
+// Copied in place, since generated code holds the addresses of the storage.
+// Chunks the previous run touched first are decommitted and read as zeroes
+// again. Code the previous run wrote over is invalidated before the next
+// dispatch, and the links broken by its halt are restored up front.
+void MmixHwImpl::restoreSnapshot() {
+	size_t chunkSize = (size_t)1 << GuestMemory::CHUNK_BITS;
+	size_t pageSize = (size_t)1 << MmixLlvm::CODE_PAGE_BITS;
+	boost::unordered_map<size_t, size_t> saved;
+	for (size_t i = 0; i < _snapshot.Chunks.size(); i++)
+		saved[_snapshot.Chunks[i]] = i;
+	std::vector<MXByte> zeroes(pageSize);
+	for (CodePageMap::iterator itr = _codePageRefs.begin(); itr != _codePageRefs.end(); ++itr) {
+		size_t offset = itr->first * pageSize;
+		if (offset >= _memory.size())
+			continue;
+		boost::unordered_map<size_t, size_t>::iterator chunk = saved.find(offset >> GuestMemory::CHUNK_BITS);
+		const MXByte* old = chunk == saved.end() ? &zeroes[0]
+			: &_snapshot.Memory[chunk->second * chunkSize + (offset & (chunkSize - 1))];
+		if (memcmp(_memory.base() + offset, old, pageSize) != 0)
+			_dirtyCodePages.push_back(itr->first);
+	}
+	std::copy(_snapshot.Registers.begin(), _snapshot.Registers.end(), _registers.begin());
+	std::copy(_snapshot.SpRegisters.begin(), _snapshot.SpRegisters.end(), _spRegisters.begin());
+	std::vector<size_t> committed;
+	_memory.getCommitted(committed);
+	for (std::vector<size_t>::iterator itr = committed.begin(); itr != committed.end(); ++itr)
+		if (saved.find(*itr) == saved.end())
+			_memory.decommit(*itr);
+	for (size_t i = 0; i < _snapshot.Chunks.size(); i++)
+		memcpy(_memory.base() + (_snapshot.Chunks[i] << GuestMemory::CHUNK_BITS), &_snapshot.Memory[i * chunkSize], chunkSize);
+	_regStack.clear();
+	_regStackTop[0] = &_registers[0];
+	_regStackBase[0] = &_registers[0];
+	_hotVertice = ~0ULL;
+	relinkPending();
+	_halted = false;
+	_preempt = 0;
+	_stopped = false;
+}
+
+void MmixHwImpl::execute(MXOcta xref) {
 	MXOcta xref0 = xref;
 	MXOcta instrAddr, targetAddr;
 	std::vector<GenericValue> args(2);
 	args[0] = GenericValue(&instrAddr);
 	args[1] = GenericValue(&targetAddr);
-	_os->loadExecutable(*this);
-	MXByte* heap = &_memory[16384];
 	while(!_halted) {
-		VerticeMap::iterator itr = _vertices.find(xref0);
-		if (itr == _vertices.end()) {
-			Vertice newVertice;
-			emitSimpleVertice(_lctx, *_module, *this, xref0, newVertice);
-			newVertice.Entry = 
-				(void (*)(MXOcta*,MXOcta*))_ee->getPointerToFunction(newVertice.Function);
-			_vertices[xref0] = newVertice;
-			itr = _vertices.find(xref0);
+		if (_preempt) {
+			_stopped = true;
+			break;
+		}
+		if (_compiledReady)
+			publishCompiled();
+		if (!_dirtyCodePages.empty())
+			invalidateDirtyCode();
+		if (_jitCfg.CodeCacheBytes > 0 && _cachedCodeBytes > _jitCfg.CodeCacheBytes)
+			evictColdVertices();
+		_codeCacheEpoch++;
+		if (!_retired.empty())
+			freeRetired();
+		CacheSlot& tc = probeTranslationCache(xref0);
+		if (tc.Xref == xref0) {
+			_stats.TranslationCacheHits++;
+		} else {
+			_stats.TranslationCacheMisses++;
+			if (!isMapped(xref0)) {
+				xref0 = raiseProtectionFault(xref0, xref0, MmixLlvm::X_BIT);
+				continue;
+			}
+			VerticeMap::iterator itr = findVertice(xref0);
+			if (itr == _vertices.end() && _jitCfg.InterpThreshold > 0) {
+				InterpBlock& b = decodeBlock(xref0);
+				if (b.Interpretable) {
+					uint64_t execCount = b.ExecCount++;
+					// With compile workers a hot block is queued once and keeps
+					// being interpreted until its code is published
+					if (execCount == _jitCfg.InterpThreshold && _jitCfg.CompileThreads > 0)
+						requestCompile(xref0, baseTier(), false, false);
+					if (execCount < _jitCfg.InterpThreshold || _jitCfg.CompileThreads > 0) {
+						_stats.InterpretedBlocks++;
+						xref0 = interpretBlock(b);
+						continue;
+					}
+				}
+			}
+			Vertice& v = itr != _vertices.end() ? itr->second : compileVertice(xref0);
+			tc.Xref = xref0;
+			tc.Entry = v.Entry;
+		}
+		EntryCall call = { tc.Entry, &instrAddr, &targetAddr };
+		GuestMemory::GuardFault fault;
+		if (!GuestMemory::guardedCall(&MmixHwImpl::callEntry, &call, fault)) {
+			xref0 = raiseGuardFault(fault, xref0);
+			continue;
+		}
+		if (_hotVertice != ~0ULL) {
+			tierUp(_hotVertice);
+			_hotVertice = ~0ULL;
 		}
-		Vertice& v = itr->second;
-		(*v.Entry)(&instrAddr, &targetAddr);
 		if ((targetAddr & (1ull << 63)) == 0) {
 			xref0 = targetAddr;
 		} else {
@@ -342,7 +1934,50 @@ void MmixHwImpl::run(MXOcta xref) {
 	}
 }
 
+void MmixHwImpl::callEntry(void* call) {
+	EntryCall* c = static_cast<EntryCall*>(call);
+	(*c->Entry)(c->InstrAddr, c->TargetAddr);
+}
+
+// Raised as a dynamic trap: the rQ bit is set, the trap registers describe
+// the instruction as TRAP would, and the OS decides what happens next.
+MXOcta MmixHwImpl::raiseProtectionFault(MXOcta instrAddr, MXOcta dataAddr, MmixLlvm::ProgramBit bit) {
+	_stats.ProtectionFaults++;
+	_spRegisters[MmixLlvm::rQ] |= (MXOcta)bit << 32;
+	_spRegisters[MmixLlvm::rWW] = instrAddr + 4;
+	_spRegisters[MmixLlvm::rXX] = (1ULL << 63) | (isMapped(instrAddr) ? readTetra(instrAddr) : 0);
+	_spRegisters[MmixLlvm::rYY] = dataAddr;
+	_spRegisters[MmixLlvm::rZZ] = 0;
+	_spRegisters[MmixLlvm::rBB] = interpReg(255);
+	interpReg(255) = _spRegisters[MmixLlvm::rJ];
+	return _os->handleTrap(*this, instrAddr, _spRegisters[MmixLlvm::rTT]);
+}
+
+// The vertice was abandoned where it faulted, so registers it kept in host
+// registers since its last exit are lost; memory is as it left it. Code
+// replaced by a tier up during the run may be what faulted, so _retired is
+// searched as well as the maps.
+MXOcta MmixHwImpl::raiseGuardFault(const GuestMemory::GuardFault& fault, MXOcta xref) {
+	MXOcta instrAddr = xref;
+	bool found = false;
+	for (VerticeMap::const_iterator itr = _vertices.begin(); itr != _vertices.end() && !found; ++itr)
+		found = locateFault(itr->second, itr->first, fault.Pc, instrAddr);
+	for (VerticeMap::const_iterator itr = _speculative.begin(); itr != _speculative.end() && !found; ++itr)
+		found = locateFault(itr->second, itr->first, fault.Pc, instrAddr);
+	for (size_t i = 0; i < _retired.size() && !found; i++)
+		found = locateFault(_retired[i].Code, _retired[i].Xref, fault.Pc, instrAddr);
+	MXOcta stride = _jitCfg.SegmentOffsetMask + 1;
+	MXOcta seg = fault.Offset / stride;
+	MXOcta dataAddr = (seg << REGION_BIT_OFFSET) | (fault.Offset - seg * stride);
+	return raiseProtectionFault(instrAddr, dataAddr, fault.Write ? MmixLlvm::W_BIT : MmixLlvm::R_BIT);
+}
+
 void MmixHwImpl::halt() {
+	// Chained vertices and translation or inline cache hits never pass through
+	// the dispatcher, so break them all to make the running code return and
+	// observe _halted.
+	unlinkAll();
+	flushTranslationCache();
 	_halted = true;
 }
 
@@ -368,42 +2003,69 @@ MXByte MmixHwImpl::readByte(MXOcta ref) {
 
 MXWyde MmixHwImpl::readWyde(MXOcta ref) {
 	MXByte* t = translateAddr(ref, 1);
+	if (_jitCfg.NativeByteOrder)
+		return *(MXWyde*)t;
 	return MmixLlvm::Util::adjust16Endianness(ArrayRef<MXByte>(t, t + 2));
 }
 
 MXTetra MmixHwImpl::readTetra(MXOcta ref) {
 	MXByte* t = translateAddr(ref, 3);
+	if (_jitCfg.NativeByteOrder)
+		return *(MXTetra*)t;
 	return MmixLlvm::Util::adjust32Endianness(ArrayRef<MXByte>(t, t + 4));
 }
 
 MXOcta MmixHwImpl::readOcta(MXOcta ref) {
 	MXByte* t = translateAddr(ref, 7);
+	if (_jitCfg.NativeByteOrder)
+		return *(MXOcta*)t;
 	return MmixLlvm::Util::adjust64Endianness(ArrayRef<MXByte>(t, t + 8));
 }
 
 void MmixHwImpl::writeByte(MXOcta ref, MXByte arg) {
 	MXByte* t = translateAddr(ref, 0);
 	*t = arg;
+	noteWrite(ref);
 }
 
 void MmixHwImpl::writeWyde(MXOcta ref, MXWyde arg) {
 	MXWyde* t = (MXWyde*)translateAddr(ref, 1);
 	MXByte* p0 = (MXByte*)&arg;
-	*t = MmixLlvm::Util::adjust16Endianness(ArrayRef<MXByte>(p0, p0 + 2));
+	*t = _jitCfg.NativeByteOrder ? arg : MmixLlvm::Util::adjust16Endianness(ArrayRef<MXByte>(p0, p0 + 2));
+	noteWrite(ref);
 }
 
 void MmixHwImpl::writeTetra(MXOcta ref, MXTetra arg) {
 	MXTetra* t = (MXTetra*)translateAddr(ref, 3);
 	MXByte* p0 = (MXByte*)&arg;
-	*t = MmixLlvm::Util::adjust32Endianness(ArrayRef<MXByte>(p0, p0 + 4));
+	*t = _jitCfg.NativeByteOrder ? arg : MmixLlvm::Util::adjust32Endianness(ArrayRef<MXByte>(p0, p0 + 4));
+	noteWrite(ref);
 }
 
 void MmixHwImpl::writeOcta(MXOcta ref, MXOcta arg) {
 	MXOcta* t = (MXOcta*)translateAddr(ref, 7);
 	MXByte* p0 = (MXByte*)&arg;
-	*t = MmixLlvm::Util::adjust64Endianness(ArrayRef<MXByte>(p0, p0 + 8));
+	*t = _jitCfg.NativeByteOrder ? arg : MmixLlvm::Util::adjust64Endianness(ArrayRef<MXByte>(p0, p0 + 8));
+	noteWrite(ref);
+}
+
+bool MmixHwImpl::isMapped(MXOcta ref) {
+	size_t seg = (size_t)((ref >> REGION_BIT_OFFSET) & TWO_ENABLED_BITS);
+	return (ref & _jitCfg.SegmentOffsetMask) < _att[2 * seg + 1];
 }
 
 MmixHwImpl::~MmixHwImpl()
 {
+	{
+		boost::lock_guard<boost::mutex> lock(_compileLock);
+		_stopping = true;
+	}
+	_compileQueued.notify_all();
+	_workers.join_all();
+	for (size_t i = 0; i < _units.size(); i++) {
+		if (_units[i]->Ee)
+			_units[i]->Ee->UnregisterJITEventListener(_units[i]->CodeListener.get());
+		if (_units[i]->Tier0Ee)
+			_units[i]->Tier0Ee->UnregisterJITEventListener(_units[i]->CodeListener.get());
+	}
 }
\ No newline at end of file
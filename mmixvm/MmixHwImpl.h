@@ -2,13 +2,24 @@
 
 #include <stdint.h>
 #include <vector>
+#include <deque>
+#include <queue>
+#include <functional>
 #include <boost/shared_ptr.hpp>
 #include <boost/scoped_ptr.hpp>
+#include <boost/shared_array.hpp>
 #include <boost/unordered_map.hpp>
+#include <boost/unordered_set.hpp>
+#include <boost/thread.hpp>
 #include <llvm/IR/LLVMContext.h>
 #include <llvm/IR/Module.h>
 #include <llvm/ExecutionEngine/ExecutionEngine.h>
+#include <llvm/ExecutionEngine/JITEventListener.h>
+#include <llvm/PassManager.h>
+#include <llvm/ADT/OwningPtr.h>
+#include <llvm/Support/MemoryBuffer.h>
 #include "Engine.h"
+#include "GuestMemory.h"
 #include "MmixDef.h"
 #include "MmixEmit.h"
 #include "OS.h"
@@ -25,23 +36,148 @@ namespace MmixLlvm {
 
 		std::vector<MXOcta> _spRegisters;
 
-		std::vector<MXByte> _memory;
+		GuestMemory _memory;
 
-		std::vector<MXTetra> _att;
+		std::vector<MXOcta> _att;
 
 		struct RegStackEntry {
 			MXOcta rL;
 
 			MXOcta* TopRef;
+
+			MXOcta ReturnXref;
+
+			// Link cell of the vertice at ReturnXref, null when not predicted
+			VerticeEntry* ReturnLink;
 		};
 
-		std::stack<RegStackEntry> _regStack;
+		// Innermost call last; a vector so that freed link cells can be
+		// scrubbed from it
+		std::vector<RegStackEntry> _regStack;
+
+		std::vector<CacheSlot> _tcache;
+
+		// Context and engine used by exactly one compiling thread; every job
+		// adds a module of its own
+		struct JitUnit {
+			llvm::LLVMContext Lctx;
+
+			// Helper library parsed into Lctx, linked into optimized jobs;
+			// null when there is none
+			boost::scoped_ptr<llvm::Module> Runtime;
+
+			// Generates code at OptLevel
+			boost::scoped_ptr<llvm::ExecutionEngine> Ee;
+
+			// Generates tier 0 code without optimization; null when tiering is
+			// off
+			boost::scoped_ptr<llvm::ExecutionEngine> Tier0Ee;
+
+			boost::scoped_ptr<llvm::JITEventListener> CodeListener;
+
+			uint64_t CodeBytes;
+
+			// Line table of the function emitted last
+			FaultMap FaultMap;
+
+			// Evicted vertice functions the owning thread has yet to erase
+			std::vector<llvm::Function*> Doomed;
+
+			unsigned Index;
+		};
+
+		typedef boost::unordered_map<std::string, void*> SymbolMap;
+
+		// Absolute addresses of the runtime globals and functions by name
+		SymbolMap _runtimeSymbols;
+
+		// Bitcode of the helper library, parsed by every unit
+		llvm::OwningPtr<llvm::MemoryBuffer> _runtimeBitcode;
+
+		// Folded into persistent cache keys since optimized vertices carry
+		// inlined copies of the helpers
+		uint64_t _runtimeHash;
+
+		// Unit 0 belongs to the guest thread, the others to compile workers
+		std::vector<boost::shared_ptr<JitUnit> > _units;
+
+		struct CompileJob {
+			MXOcta Xref;
+
+			unsigned Tier;
+
+			bool Speculative;
+
+			// Follows every static exit into the text sections, unbudgeted
+			bool Ahead;
+
+			// Further addresses already claimed at Tier, emitted into the same
+			// module as Xref
+			std::vector<MXOcta> Batch;
+
+			// Code of Xref, Batch and the vertices a worker may batch with
+			// them, read when the job was queued
+			CodeSnapshot Code;
+
+			// _codeGeneration when Code was read
+			long Generation;
+
+			// Host pages Code was read from, held until the job is done
+			std::vector<size_t> Pages;
+		};
+
+		struct CompileResult {
+			MXOcta Xref;
+
+			bool Speculative;
+
+			Vertice Compiled;
+
+			uint64_t IrInstructions;
+
+			// Estimated IR emitted before release
+			uint64_t IrBytes;
+
+			uint64_t CompileMicroseconds;
+
+			// _codeGeneration when the code was read
+			long Generation;
+
+			// Key into the persistent cache, valid when CacheDir is set
+			uint64_t CacheKey;
+
+			// Read back from the persistent cache, or written to it
+			bool Cached;
+
+			bool Stored;
+		};
+
+		typedef std::pair<MXOcta, unsigned> CompileKey;
+
+		std::deque<CompileJob> _compileQueue;
+
+		// Addresses queued or in flight at a tier, released when the result is
+		// published or dropped
+		boost::unordered_set<CompileKey> _compileKeys;
+
+		std::vector<CompileResult> _compiled;
+
+		// Pages held by the jobs workers are done with, released along with
+		// their results
+		std::vector<size_t> _releasedPages;
+
+		// Nonzero while _compiled holds results, polled without the lock
+		volatile long _compiledReady;
+
+		bool _stopping;
 
-		llvm::Module* _module;
+		boost::mutex _compileLock;
 
-		llvm::LLVMContext _lctx;
+		boost::condition_variable _compileQueued;
 
-		boost::scoped_ptr<llvm::ExecutionEngine> _ee;
+		boost::condition_variable _compileDone;
+
+		boost::thread_group _workers;
 
 		boost::shared_ptr<OS> _os;
 
@@ -49,42 +185,345 @@ namespace MmixLlvm {
 
 		VerticeMap _vertices;
 
+		// Speculatively compiled vertices the guest has not reached yet,
+		// unlinked until then
+		VerticeMap _speculative;
+
+		struct RetiredVertice {
+			// Dispatcher epoch it was replaced in
+			uint64_t Epoch;
+
+			MXOcta Xref;
+
+			Vertice Code;
+		};
+
+		// Vertices replaced by a higher tier whose code may still run
+		std::vector<RetiredVertice> _retired;
+
+		// Set by tier 0 code that crossed TierUpThreshold, ~0 otherwise
+		MXOcta _hotVertice;
+
+		// Bumped on every dispatch, stamped by vertices on entry
+		uint64_t _codeCacheEpoch;
+
+		// Machine code of the vertices in _vertices and _retired
+		uint64_t _cachedCodeBytes;
+
+		boost::unordered_set<MXOcta> _evicted;
+
+		typedef std::pair<uint64_t, MXOcta> UseStamp;
+
+		typedef std::priority_queue<UseStamp, std::vector<UseStamp>, std::greater<UseStamp> > UseHeap;
+
+		// Vertices by the use stamp they had when pushed, which is never newer
+		// than their current one, least recently used on top. Entries of
+		// vertices since discarded are dropped as they surface.
+		UseHeap _coldVertices;
+
+		// Host memory behind link cells, counters, use stamps and inline
+		// caches, which the JIT would allocate and never free. Carved from
+		// blocks and recycled by size in words.
+		std::vector<boost::shared_array<uint64_t> > _cellBlocks;
+
+		size_t _cellBlockUsed;
+
+		boost::unordered_map<size_t, std::vector<uint64_t*> > _freeCells;
+
+		boost::mutex _cellLock;
+
+		// Nonzero for every host page of _memory some vertice, decoded block
+		// or queued job was read from, tested by generated stores
+		GuestMemory _codePages;
+
+		struct CodePageRefs {
+			// Start of every vertice in _vertices and _speculative translated
+			// from the page, once per vertice
+			std::vector<MXOcta> Vertices;
+
+			// Decoded blocks and queued compile jobs that read the page
+			unsigned Readers;
+		};
+
+		typedef boost::unordered_map<size_t, CodePageRefs> CodePageMap;
+
+		// Host pages code was read from, and by what. A page keeps its entry
+		// while its flag is cleared by a write, until the readers are gone.
+		CodePageMap _codePageRefs;
+
+		// Host pages written or synced, invalidated by the dispatcher
+		std::vector<size_t> _dirtyCodePages;
+
+		// Bumped on every invalidation; compile results from an older
+		// generation may have read stale code
+		volatile long _codeGeneration;
+
+		// Generation of the last invalidation of each host page that has seen
+		// one. A result is stale when one of its pages is newer than it.
+		boost::unordered_map<size_t, long> _pageGenerations;
+
+		// Bounds ahead of time discovery, sorted by start
+		std::vector<std::pair<MXOcta, MXOcta> > _textSections;
+
+		struct DecodedInstr {
+			MXByte Op;
+
+			MXByte X;
+
+			MXByte Y;
+
+			MXByte Z;
+
+			// Y and Z name registers the instruction reads; a Z that does not
+			// is Imm or unused
+			bool RegY;
+
+			bool RegZ;
+
+			// Immediate Z, shifted wyde, or branch/JMP/GETA target
+			MXOcta Imm;
+		};
+
+		struct InterpBlock {
+			std::vector<DecodedInstr> Code;
+
+			// Address following the last decoded instruction
+			MXOcta Next;
+
+			uint64_t ExecCount;
+
+			// False when the block holds an opcode only the JIT implements
+			bool Interpretable;
+		};
+
+		typedef boost::unordered_map<MXOcta, InterpBlock> InterpBlockMap;
+
+		InterpBlockMap _interpBlocks;
+
+		typedef boost::unordered_multimap<MXOcta, VerticeEntry*> LinkMap;
+
+		LinkMap _pendingLinks;
+
+		// Every link cell of a linked vertice, live or retired, by target
+		LinkMap _linkCells;
+
+		JitCfg _jitCfg;
+
+		JitStats _stats;
+
 		bool _halted;
+
+		// Polled by vertices built with EnablePreemption and by the
+		// dispatcher; set from any thread by requestStop
+		volatile long _preempt;
+
+		bool _stopped;
+
+		struct Snapshot {
+			std::vector<MXOcta> Registers;
+
+			std::vector<MXOcta> SpRegisters;
+
+			// Committed chunks of _memory and their contents, back to back
+			std::vector<size_t> Chunks;
+
+			std::vector<MXByte> Memory;
+		};
+
+		Snapshot _snapshot;
 		
-		MmixHwImpl(const HardwareCfg& hwCfg, boost::shared_ptr<OS> os);
+		MmixHwImpl(const HardwareCfg& hwCfg, const JitCfg& jitCfg, boost::shared_ptr<OS> os);
 
 		void postInit();
 
+		void declareRuntime(llvm::LLVMContext& ctx, llvm::Module& m);
+
+		void initJitUnit(JitUnit& unit);
+
+		llvm::ExecutionEngine& getEngine(JitUnit& unit, unsigned tier);
+
+		void mapRuntime(llvm::ExecutionEngine& ee, llvm::Module& m);
+
+		void inlineRuntime(JitUnit& unit, llvm::Module& m);
+
+		llvm::FunctionPassManager* createPassPipeline(JitUnit& unit, llvm::Module* m);
+
+		unsigned baseTier() const;
+
+		bool claimCompile(MXOcta xref, unsigned tier);
+
+		bool isBatchable(MXOcta xref, bool ahead);
+
+		void snapshotJob(CompileJob& job);
+
+		void translateJob(JitUnit& unit, CompileJob& job, std::vector<CompileResult>& out);
+
+		void compileOnGuest(MXOcta xref, unsigned tier, bool ahead);
+
+		void translateOnGuest(CompileJob& job);
+
+		void compileAhead(MXOcta xref);
+
+		bool isText(MXOcta xref) const;
+
+		void releaseIr(const std::vector<llvm::Module*>& modules, std::vector<CompileResult>& out, size_t first);
+
+		std::string getCachePath(uint64_t key) const;
+
+		llvm::Module* loadCachedVertice(JitUnit& unit, uint64_t key, Vertice& out);
+
+		bool storeCachedVertice(llvm::Module& m, const Vertice& v, uint64_t key);
+
+		void publishVertice(CompileResult& r);
+
+		bool readStaleCode(const CompileResult& r);
+
+		void rearmCompile(MXOcta xref, unsigned tier);
+
+		void requestCompile(MXOcta xref, unsigned tier, bool urgent, bool speculative);
+
+		void speculateSuccessors(const Vertice& v);
+
+		VerticeMap::iterator findVertice(MXOcta xref);
+
+		void publishCompiled();
+
+		void compileWorker(JitUnit* unit);
+
+		Vertice& compileVertice(MXOcta xref);
+
+		void tierUp(MXOcta xref);
+
+		void useVertice(MXOcta xref, Vertice& v);
+
+		void evictColdVertices();
+
+		void discardVertices(const std::vector<MXOcta>& victims);
+
+		void dropCells(Vertice& v);
+
+		void freeRetired();
+
+		size_t getCodePage(MXOcta xref);
+
+		void addCodePages(MXOcta xref, const Vertice& v);
+
+		void removeCodePages(MXOcta xref, const Vertice& v);
+
+		void holdCodePage(size_t page);
+
+		void releaseCodePage(size_t page);
+
+		void holdCodePages(MXOcta begin, MXOcta end);
+
+		void releaseCodePages(MXOcta begin, MXOcta end);
+
+		void detachVertices(const std::vector<MXOcta>& xrefs);
+
+		void noteWrite(MXOcta xref);
+
+		void invalidateDirtyCode();
+
+		void unlinkTarget(MXOcta xref);
+
+		void clearInlineCaches(Vertice& v, const boost::unordered_set<MXOcta>& targets);
+
+		uint64_t* allocCell(size_t words);
+
+		void mapCells(llvm::ExecutionEngine& ee, Vertice& v);
+
+		void releaseCells(Vertice& v);
+
+		void freeVertice(Vertice& v);
+
+		void eraseVerticeFunction(JitUnit& unit, llvm::Function* f);
+
+		void redirectEntry(MXOcta xref, VerticeEntry from, VerticeEntry to);
+
+		void redirectCells(Vertice& v, MXOcta xref, VerticeEntry from, VerticeEntry to);
+
+		InterpBlock& decodeBlock(MXOcta xref);
+
+		MXOcta interpretBlock(const InterpBlock& b);
+
+		MXOcta& interpReg(MXByte reg);
+
+		void interpAssign(MXByte reg, MXOcta val);
+
+		void linkVertice(MXOcta xref, Vertice& v);
+
+		void relinkPending();
+
+		void unlinkAll();
+
+		void unlinkVertice(Vertice& v);
+
+		CacheSlot& probeTranslationCache(MXOcta xref);
+
+		void flushTranslationCache();
+
 		MXByte* translateAddr(MXOcta addr, MXByte mask);
 
 		static void debugInt32(int arg);
 
 		static void debugInt64(int64_t arg);
 	
-		static void muluImpl(MXOcta arg1, MXOcta arg2, MXOcta* hiProd, MXOcta* loProd);
+		static MXOcta trapHandlerImpl(void* handback, MXOcta instr, MXOcta vector);
 
-		static MXOcta morImpl(MXOcta arg1, MXOcta arg2);
+		static void codeWritten0(void* handback, MXOcta xref);
 
-		static MXOcta mxorImpl(MXOcta arg1, MXOcta arg2);
+		void codeWritten(MXOcta xref);
 
-		static void divuImpl(MXOcta hidivident, MXOcta lodivident, MXOcta divisor, MXOcta* quotient, MXOcta* remainder);
+		static void syncId0(void* handback, MXOcta xref, MXOcta count);
 
-		static MXOcta trapHandlerImpl(void* handback, MXOcta instr, MXOcta vector);
+		void syncId(MXOcta xref, MXOcta count);
 
-		static MXOcta adjust64EndiannessImpl(MXOcta arg);
+		MXOcta raiseProtectionFault(MXOcta instrAddr, MXOcta dataAddr, MmixLlvm::ProgramBit bit);
 
-		static void pushRegStack0(void* handback, MXOcta count, MXOcta rL);
+		MXOcta raiseGuardFault(const GuestMemory::GuardFault& fault, MXOcta xref);
 
-		void pushRegStack(MXOcta count, MXOcta rL);
+		static void callEntry(void* call);
 
-		static void popRegStack0(void* handback, MXOcta count, MXOcta* rL);
+		static void pushRegStack0(void* handback, MXOcta count, MXOcta rL,
+			MXOcta returnXref, VerticeEntry* returnLink);
 
-		void popRegStack(MXOcta count, MXOcta* rL);
+		void pushRegStack(MXOcta count, MXOcta rL, MXOcta returnXref, VerticeEntry* returnLink);
+
+		static VerticeEntry popRegStack0(void* handback, MXOcta count, MXOcta* rL, MXOcta target);
+
+		VerticeEntry popRegStack(MXOcta count, MXOcta* rL, MXOcta target);
 	public:
-		static boost::shared_ptr<MmixHwImpl> create(const HardwareCfg& hwCfg, boost::shared_ptr<OS> os);
+		static boost::shared_ptr<MmixHwImpl> create(const HardwareCfg& hwCfg, const JitCfg& jitCfg,
+			boost::shared_ptr<OS> os);
+
+		const JitStats& getStats() const;
+
+		void resetStats();
 
 		virtual void run(MXOcta xref);
 
+		// run in two steps: load reads the executable and compiles it ahead
+		// of time when enabled, returning its entry point, which execute then
+		// runs the guest from.
+		MXOcta load();
+
+		void execute(MXOcta xref);
+
+		// Makes execute return at the next vertice entry or loop back edge,
+		// before the guest halts. Safe from any thread; compiled code only
+		// notices with EnablePreemption, and a guest blocked in a trap is
+		// not interrupted.
+		void requestStop();
+
+		// Whether the last execute ended through requestStop
+		bool wasStopped() const;
+
+		// Saves the guest state after load so that many runs can start from
+		// it and share the code compiled so far.
+		void takeSnapshot();
+
+		void restoreSnapshot();
+
 		virtual void halt();
 
 		virtual MXOcta getReg(MXByte reg);
@@ -111,6 +550,8 @@ namespace MmixLlvm {
 
 		virtual void writeOcta(MXOcta ref, MXOcta arg);
 
+		virtual bool isMapped(MXOcta ref);
+
 		virtual ~MmixHwImpl();
 	};
 };
\ No newline at end of file
@@ -0,0 +1,293 @@
+#include "stdafx.h"
+#include "MmixHwImpl.h"
+
+using MmixLlvm::MmixHwImpl;
+using MmixLlvm::MXByte;
+using MmixLlvm::MXWyde;
+using MmixLlvm::MXTetra;
+using MmixLlvm::MXOcta;
+
+namespace {
+	enum { MAX_BLOCK_INSTRS = 256 };
+
+	// Opcodes the interpreter runs itself. Everything that can trip, touches
+	// the register stack or calls into the OS is left to the JIT, so a block
+	// containing one is compiled right away.
+	bool isInterpretable(MXByte o0) {
+		switch (o0) {
+		case MmixLlvm::ADDU: case MmixLlvm::ADDUI:
+		case MmixLlvm::_2ADDU: case MmixLlvm::_2ADDUI:
+		case MmixLlvm::_4ADDU: case MmixLlvm::_4ADDUI:
+		case MmixLlvm::_8ADDU: case MmixLlvm::_8ADDUI:
+		case MmixLlvm::_16ADDU: case MmixLlvm::_16ADDUI:
+		case MmixLlvm::SUBU: case MmixLlvm::SUBUI:
+		case MmixLlvm::CMP: case MmixLlvm::CMPI:
+		case MmixLlvm::CMPU: case MmixLlvm::CMPUI:
+		case MmixLlvm::SLU: case MmixLlvm::SLUI:
+		case MmixLlvm::SRU: case MmixLlvm::SRUI:
+		case MmixLlvm::AND: case MmixLlvm::ANDI:
+		case MmixLlvm::OR: case MmixLlvm::ORI:
+		case MmixLlvm::XOR: case MmixLlvm::XORI:
+		case MmixLlvm::ANDN: case MmixLlvm::ANDNI:
+		case MmixLlvm::ORN: case MmixLlvm::ORNI:
+		case MmixLlvm::NAND: case MmixLlvm::NANDI:
+		case MmixLlvm::NOR: case MmixLlvm::NORI:
+		case MmixLlvm::NXOR: case MmixLlvm::NXORI:
+		case MmixLlvm::SETH: case MmixLlvm::SETMH: case MmixLlvm::SETML: case MmixLlvm::SETL:
+		case MmixLlvm::INCH: case MmixLlvm::INCMH: case MmixLlvm::INCML: case MmixLlvm::INCL:
+		case MmixLlvm::ORH: case MmixLlvm::ORMH: case MmixLlvm::ORML: case MmixLlvm::ORL:
+		case MmixLlvm::LDB: case MmixLlvm::LDBI: case MmixLlvm::LDBU: case MmixLlvm::LDBUI:
+		case MmixLlvm::LDW: case MmixLlvm::LDWI: case MmixLlvm::LDWU: case MmixLlvm::LDWUI:
+		case MmixLlvm::LDT: case MmixLlvm::LDTI: case MmixLlvm::LDTU: case MmixLlvm::LDTUI:
+		case MmixLlvm::LDO: case MmixLlvm::LDOI: case MmixLlvm::LDOU: case MmixLlvm::LDOUI:
+		case MmixLlvm::LDHT: case MmixLlvm::LDHTI:
+		case MmixLlvm::STBU: case MmixLlvm::STBUI:
+		case MmixLlvm::STWU: case MmixLlvm::STWUI:
+		case MmixLlvm::STTU: case MmixLlvm::STTUI:
+		case MmixLlvm::STO: case MmixLlvm::STOI: case MmixLlvm::STOU: case MmixLlvm::STOUI:
+		case MmixLlvm::STHT: case MmixLlvm::STHTI:
+		case MmixLlvm::STCO: case MmixLlvm::STCOI:
+		case MmixLlvm::GETA: case MmixLlvm::GETAB:
+		case MmixLlvm::JMP: case MmixLlvm::JMPB:
+			return true;
+		default:
+			return (o0 >= MmixLlvm::BN && o0 <= MmixLlvm::PBEVB)
+				|| (o0 >= MmixLlvm::CSN && o0 <= MmixLlvm::ZSEVI);
+		}
+	}
+
+	bool isLoad(MXByte o0) {
+		return o0 >= MmixLlvm::LDB && o0 <= MmixLlvm::LDHTI;
+	}
+
+	bool isStore(MXByte o0) {
+		return o0 >= MmixLlvm::STB && o0 <= MmixLlvm::STCOI;
+	}
+
+	bool isBlockEnd(MXByte o0) {
+		return (o0 >= MmixLlvm::BN && o0 <= MmixLlvm::PBEVB) || o0 == MmixLlvm::JMP || o0 == MmixLlvm::JMPB;
+	}
+
+	// Condition shared by B, PB, CS and ZS, selected by bits 1-3 of the opcode
+	bool testCond(MXByte o0, MXOcta val) {
+		switch (o0 & 0xE) {
+		case 0x0: return (int64_t)val < 0;
+		case 0x2: return val == 0;
+		case 0x4: return (int64_t)val > 0;
+		case 0x6: return (val & 1) != 0;
+		case 0x8: return (int64_t)val >= 0;
+		case 0xA: return val != 0;
+		case 0xC: return (int64_t)val <= 0;
+		default: return (val & 1) == 0;
+		}
+	}
+
+	MXOcta decodeTarget(MXOcta xptr, MXTetra offset, bool backward) {
+		return !backward ? xptr + ((MXOcta)offset << 2) : xptr - ((MXOcta)offset << 2);
+	}
+};
+
+MmixHwImpl::InterpBlock& MmixHwImpl::decodeBlock(MXOcta xref) {
+	InterpBlockMap::iterator itr = _interpBlocks.find(xref);
+	if (itr != _interpBlocks.end())
+		return itr->second;
+	InterpBlock& b = _interpBlocks[xref];
+	b.ExecCount = 0;
+	b.Interpretable = true;
+	MXOcta xptr = xref;
+	for (;;) {
+		// Left for the JIT, whose region ends there with a trap
+		if (!isMapped(xptr)) {
+			b.Interpretable = false;
+			break;
+		}
+		MXTetra instr = readTetra(xptr);
+		DecodedInstr d;
+		d.Op = (MXByte) (instr >> 24);
+		d.X = (MXByte) (instr >> 16);
+		d.Y = (MXByte) (instr >> 8);
+		d.Z = (MXByte) instr;
+		d.RegY = false;
+		d.RegZ = false;
+		d.Imm = 0;
+		if (!isInterpretable(d.Op)) {
+			b.Interpretable = false;
+			break;
+		}
+		MXWyde yz = ((MXWyde)d.Y << 8) | d.Z;
+		if (d.Op >= MmixLlvm::SETH && d.Op <= MmixLlvm::ORL)
+			d.Imm = (MXOcta)yz << ((3 - (d.Op & 3)) << 4);
+		else if (d.Op >= MmixLlvm::BN && d.Op <= MmixLlvm::PBEVB)
+			d.Imm = decodeTarget(xptr, yz, (d.Op & 1) != 0);
+		else if (d.Op == MmixLlvm::JMP || d.Op == MmixLlvm::JMPB)
+			d.Imm = decodeTarget(xptr, instr & 0xFFFFFF, d.Op == MmixLlvm::JMPB);
+		else if (d.Op == MmixLlvm::GETA || d.Op == MmixLlvm::GETAB)
+			d.Imm = decodeTarget(xptr, yz, d.Op == MmixLlvm::GETAB);
+		else {
+			// Arithmetic, loads, stores, CS and ZS: the odd opcode of each pair
+			// takes Z as an immediate
+			d.RegY = true;
+			d.RegZ = (d.Op & 1) == 0;
+			if (!d.RegZ)
+				d.Imm = d.Z;
+		}
+		b.Code.push_back(d);
+		xptr += sizeof(MXTetra);
+		if (isBlockEnd(d.Op) || b.Code.size() == MAX_BLOCK_INSTRS)
+			break;
+	}
+	b.Next = xptr;
+	// A store to the block now reaches codeWritten, which invalidates it
+	holdCodePages(xref, b.Next);
+	return b;
+}
+
+MXOcta& MmixHwImpl::interpReg(MXByte reg) {
+	return reg < _spRegisters[MmixLlvm::rG] ? _regStackTop[0][reg] : _regStackBase[0][reg];
+}
+
+void MmixHwImpl::interpAssign(MXByte reg, MXOcta val) {
+	MXOcta& rL = _spRegisters[MmixLlvm::rL];
+	if (reg >= rL && reg < _spRegisters[MmixLlvm::rG])
+		rL = (MXOcta)reg + 1;
+	interpReg(reg) = val;
+}
+
+// Operands are pre-decoded, so the loop below is a dense switch over the
+// opcode byte; MSVC has no computed goto, and lowers this to a jump table.
+// Unlike generated code, loads and stores check their address up front.
+MXOcta MmixHwImpl::interpretBlock(const InterpBlock& b) {
+	const DecodedInstr* d = &b.Code[0];
+	const DecodedInstr* end = d + b.Code.size();
+	for (; d != end; ++d) {
+		MXOcta y = d->RegY ? interpReg(d->Y) : 0;
+		MXOcta z = d->RegZ ? interpReg(d->Z) : d->Imm;
+		if ((isLoad(d->Op) || isStore(d->Op)) && !isMapped(y + z)) {
+			MXOcta instrAddr = b.Next - (MXOcta)(end - d) * sizeof(MXTetra);
+			return raiseProtectionFault(instrAddr, y + z, isStore(d->Op) ? MmixLlvm::W_BIT : MmixLlvm::R_BIT);
+		}
+		switch (d->Op) {
+		case MmixLlvm::ADDU: case MmixLlvm::ADDUI:
+			interpAssign(d->X, y + z);
+			break;
+		case MmixLlvm::_2ADDU: case MmixLlvm::_2ADDUI:
+			interpAssign(d->X, (y << 1) + z);
+			break;
+		case MmixLlvm::_4ADDU: case MmixLlvm::_4ADDUI:
+			interpAssign(d->X, (y << 2) + z);
+			break;
+		case MmixLlvm::_8ADDU: case MmixLlvm::_8ADDUI:
+			interpAssign(d->X, (y << 3) + z);
+			break;
+		case MmixLlvm::_16ADDU: case MmixLlvm::_16ADDUI:
+			interpAssign(d->X, (y << 4) + z);
+			break;
+		case MmixLlvm::SUBU: case MmixLlvm::SUBUI:
+			interpAssign(d->X, y - z);
+			break;
+		case MmixLlvm::CMP: case MmixLlvm::CMPI:
+			interpAssign(d->X, (MXOcta)(((int64_t)y > (int64_t)z) - ((int64_t)y < (int64_t)z)));
+			break;
+		case MmixLlvm::CMPU: case MmixLlvm::CMPUI:
+			interpAssign(d->X, (MXOcta)((y > z) - (y < z)));
+			break;
+		case MmixLlvm::SLU: case MmixLlvm::SLUI:
+			interpAssign(d->X, z < 64 ? y << z : 0);
+			break;
+		case MmixLlvm::SRU: case MmixLlvm::SRUI:
+			interpAssign(d->X, z < 64 ? y >> z : 0);
+			break;
+		case MmixLlvm::AND: case MmixLlvm::ANDI:
+			interpAssign(d->X, y & z);
+			break;
+		case MmixLlvm::OR: case MmixLlvm::ORI:
+			interpAssign(d->X, y | z);
+			break;
+		case MmixLlvm::XOR: case MmixLlvm::XORI:
+			interpAssign(d->X, y ^ z);
+			break;
+		case MmixLlvm::ANDN: case MmixLlvm::ANDNI:
+			interpAssign(d->X, y & ~z);
+			break;
+		case MmixLlvm::ORN: case MmixLlvm::ORNI:
+			interpAssign(d->X, y | ~z);
+			break;
+		case MmixLlvm::NAND: case MmixLlvm::NANDI:
+			interpAssign(d->X, ~(y & z));
+			break;
+		case MmixLlvm::NOR: case MmixLlvm::NORI:
+			interpAssign(d->X, ~(y | z));
+			break;
+		case MmixLlvm::NXOR: case MmixLlvm::NXORI:
+			interpAssign(d->X, ~(y ^ z));
+			break;
+		case MmixLlvm::SETH: case MmixLlvm::SETMH: case MmixLlvm::SETML: case MmixLlvm::SETL:
+			interpAssign(d->X, d->Imm);
+			break;
+		case MmixLlvm::INCH: case MmixLlvm::INCMH: case MmixLlvm::INCML: case MmixLlvm::INCL:
+			interpAssign(d->X, interpReg(d->X) + d->Imm);
+			break;
+		case MmixLlvm::ORH: case MmixLlvm::ORMH: case MmixLlvm::ORML: case MmixLlvm::ORL:
+			interpAssign(d->X, interpReg(d->X) | d->Imm);
+			break;
+		case MmixLlvm::LDB: case MmixLlvm::LDBI:
+			interpAssign(d->X, (MXOcta)(int8_t)readByte(y + z));
+			break;
+		case MmixLlvm::LDBU: case MmixLlvm::LDBUI:
+			interpAssign(d->X, readByte(y + z));
+			break;
+		case MmixLlvm::LDW: case MmixLlvm::LDWI:
+			interpAssign(d->X, (MXOcta)(int16_t)readWyde(y + z));
+			break;
+		case MmixLlvm::LDWU: case MmixLlvm::LDWUI:
+			interpAssign(d->X, readWyde(y + z));
+			break;
+		case MmixLlvm::LDT: case MmixLlvm::LDTI:
+			interpAssign(d->X, (MXOcta)(int32_t)readTetra(y + z));
+			break;
+		case MmixLlvm::LDTU: case MmixLlvm::LDTUI:
+			interpAssign(d->X, readTetra(y + z));
+			break;
+		case MmixLlvm::LDO: case MmixLlvm::LDOI: case MmixLlvm::LDOU: case MmixLlvm::LDOUI:
+			interpAssign(d->X, readOcta(y + z));
+			break;
+		case MmixLlvm::LDHT: case MmixLlvm::LDHTI:
+			interpAssign(d->X, (MXOcta)readTetra(y + z) << 32);
+			break;
+		case MmixLlvm::STBU: case MmixLlvm::STBUI:
+			writeByte(y + z, (MXByte)interpReg(d->X));
+			break;
+		case MmixLlvm::STWU: case MmixLlvm::STWUI:
+			writeWyde(y + z, (MXWyde)interpReg(d->X));
+			break;
+		case MmixLlvm::STTU: case MmixLlvm::STTUI:
+			writeTetra(y + z, (MXTetra)interpReg(d->X));
+			break;
+		case MmixLlvm::STO: case MmixLlvm::STOI: case MmixLlvm::STOU: case MmixLlvm::STOUI:
+			writeOcta(y + z, interpReg(d->X));
+			break;
+		case MmixLlvm::STHT: case MmixLlvm::STHTI:
+			writeTetra(y + z, (MXTetra)(interpReg(d->X) >> 32));
+			break;
+		case MmixLlvm::STCO: case MmixLlvm::STCOI:
+			writeOcta(y + z, d->X);
+			break;
+		case MmixLlvm::GETA: case MmixLlvm::GETAB:
+			interpAssign(d->X, d->Imm);
+			break;
+		case MmixLlvm::JMP: case MmixLlvm::JMPB:
+			return d->Imm;
+		default:
+			if (d->Op >= MmixLlvm::BN && d->Op <= MmixLlvm::PBEVB) {
+				if (testCond(d->Op, interpReg(d->X)))
+					return d->Imm;
+			} else if (d->Op >= MmixLlvm::ZSN) {
+				interpAssign(d->X, testCond(d->Op, y) ? z : 0);
+			} else if (testCond(d->Op, y)) {
+				interpAssign(d->X, z);
+			}
+			break;
+		}
+	}
+	return b.Next;
+}
@@ -1,12 +1,19 @@
 #pragma once
 
 #include <stdint.h>
+#include <vector>
+#include <utility>
 #include "Engine.h"
 #include "MmixDef.h"
 
 namespace MmixLlvm {
 	struct OS {
 		virtual void loadExecutable(Engine& e) = 0;
+		// Address ranges [first, second) of the text sections loaded last
+		virtual void getTextSections(std::vector<std::pair<MXOcta, MXOcta> >& out) = 0;
+		// Address of Main in the executable loaded last, #100 when it does
+		// not say
+		virtual MXOcta getEntryPoint() = 0;
 		virtual MXOcta handleTrap(Engine& e, MXOcta instr, MXOcta vector) = 0;
 		virtual ~OS() = 0;
 	};
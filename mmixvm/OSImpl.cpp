@@ -15,27 +15,50 @@ using MmixLlvm::MXOcta;
 
 OSImpl::OSImpl(const std::vector<std::wstring >& argv)
 	:_argv(argv)
+	,_topDataSegAddr(MmixLlvm::DATA_SEG)
+	,_out(0)
+	,_entryPoint(0x100)
 {}
 
 void OSImpl::loadExecutable(Engine& e) {
 	e.setSpReg(MmixLlvm::rT, MmixLlvm::OS_TRAP_VECTOR);
 	MXOcta topDataSegAddr = MmixLlvm::DATA_SEG;
+	_textSections.clear();
+	_entryPoint = 0x100;
 	std::ifstream f(_argv[0], std::ios::binary);
 	while (!f.eof()) {
 		bool isGreg = false;
 		MXOcta loc = 0;
 		size_t size = 0;
-		readSection(e, f, isGreg, loc, size);
+		readSection(e, f, isGreg, loc, size, _entryPoint);
 		if (!isGreg) {
 			bool isDataSeg = loc >= MmixLlvm::DATA_SEG && loc < MmixLlvm::POOL_SEG;
 			MXOcta segTop = loc + size;
 			if (isDataSeg && topDataSegAddr < segTop)
 				topDataSegAddr = segTop;
+			if (size > 0 && loc < MmixLlvm::DATA_SEG)
+				_textSections.push_back(std::make_pair(loc, segTop));
 		}
 	}
+	_topDataSegAddr = topDataSegAddr;
 	makeArgv(e, topDataSegAddr);
 }
 
+void OSImpl::startJob(Engine& e, const std::vector< std::wstring >& args, void* out) {
+	_argv.resize(1);
+	_argv.insert(_argv.end(), args.begin(), args.end());
+	_out = out;
+	makeArgv(e, _topDataSegAddr);
+}
+
+void OSImpl::getTextSections(std::vector< std::pair<MXOcta, MXOcta> >& out) {
+	out = _textSections;
+}
+
+MXOcta OSImpl::getEntryPoint() {
+	return _entryPoint;
+}
+
 void OSImpl::makeArgv(Engine& e, MXOcta topDataSegAddr) {
 	std::vector<MXByte> result;
 	std::vector<size_t> offsets;
@@ -63,8 +86,10 @@ void OSImpl::makeArgv(Engine& e, MXOcta topDataSegAddr) {
 	}
 	e.writeOcta (ref, 0);
 	ref += 8;
-	for (size_t i = 0; i < result.size(); i++)
-		e.writeByte(ref + i, result[i]);
+	// Every string is padded to whole octabytes
+	ArrayRef<MXByte> strings(result);
+	for (size_t i = 0; i < result.size(); i += 8)
+		e.writeOcta(ref + i, MmixLlvm::Util::adjust64Endianness(strings.slice(i, 8)));
 	e.setReg(0, _argv.size());
 	e.setReg(1, topDataSegAddr);
 }
@@ -76,6 +101,14 @@ MXOcta OSImpl::handleTrap(Engine& e, MXOcta instr, MXOcta vector) {
 		  Fputs = 7,  Fputws = 8,
 		  Fseek = 9,  Ftell = 10
 	};
+	// Protection faults come here as dynamic traps; there is no guest
+	// handler to pass them to, so the program ends
+	MXOcta protection = (MXOcta)(MmixLlvm::R_BIT | MmixLlvm::W_BIT | MmixLlvm::X_BIT) << 32;
+	if ((e.getSpReg(MmixLlvm::rQ) & protection) != 0) {
+		reportProtectionFault(e, instr, e.getSpReg(MmixLlvm::rYY));
+		return e.getSpReg(MmixLlvm::rWW);
+	}
+	MXOcta fault;
 	switch (e.getSpReg(MmixLlvm::rYY)) 
 	{
 	case Fopen:
@@ -91,7 +124,8 @@ MXOcta OSImpl::handleTrap(Engine& e, MXOcta instr, MXOcta vector) {
 	case Fwrite:
 		break;
 	case Fputs:
-		doFputs(e, e.getSpReg(rBB), e.getSpReg(rXX), e.getSpReg(rYY), e.getSpReg(rZZ));
+		if (!doFputs(e, e.getSpReg(rBB), e.getSpReg(rXX), e.getSpReg(rYY), e.getSpReg(rZZ), fault))
+			reportProtectionFault(e, instr, fault);
 		break;
 	case Fputws:
 		break;
@@ -105,33 +139,60 @@ MXOcta OSImpl::handleTrap(Engine& e, MXOcta instr, MXOcta vector) {
 	return e.getSpReg(MmixLlvm::rWW);
 }
 
-void OSImpl::doFputs(Engine& e, MXOcta rBB, MXOcta rXX, MXOcta rYY, MXOcta rZZ) {
+void OSImpl::reportProtectionFault(Engine& e, MXOcta instr, MXOcta addr) {
+	llvm::errs() << "protection fault at #";
+	llvm::errs().write_hex(instr) << ", address #";
+	llvm::errs().write_hex(addr) << '\n';
+	e.halt();
+}
+
+// The guest pointer is checked before every read: a guard fault here would
+// unwind through this frame.
+bool OSImpl::doFputs(Engine& e, MXOcta rBB, MXOcta rXX, MXOcta rYY, MXOcta rZZ, MXOcta& fault) {
 	MXOcta p0 = rBB;
 	MXByte c;
 	std::vector<MXByte> tmp;
-	while ((c = e.readByte(p0++)) != 0)
+	for (;;) {
+		if (!e.isMapped(p0)) {
+			fault = p0;
+			return false;
+		}
+		if ((c = e.readByte(p0++)) == 0)
+			break;
 		tmp.push_back(c);
+	}
 	HANDLE h;
 	switch (rZZ) {
 	case 1:
-		h = GetStdHandle(STD_OUTPUT_HANDLE);
+		h = _out ? (HANDLE)_out : GetStdHandle(STD_OUTPUT_HANDLE);
 		break;
 	case 2:
-		h = GetStdHandle(STD_ERROR_HANDLE);
+		h = _out ? (HANDLE)_out : GetStdHandle(STD_ERROR_HANDLE);
 		break;
 	default:
 		h = (HANDLE)rZZ;
 	}
 	DWORD bytesWritten;
 	::WriteFile(h, &tmp[0], tmp.size(), &bytesWritten, NULL);
+	return true;
 }
 
-void OSImpl::readSection(Engine& e, std::istream& stream, bool& isGreg, MXOcta& loc, size_t& size) {
+// A .main section only carries the address of Main; executables from older
+// assemblers have none.
+void OSImpl::readSection(Engine& e, std::istream& stream, bool& isGreg, MXOcta& loc, size_t& size,
+	MXOcta& entry)
+{
 	enum {SECTION_ALIGN = 0x20};
 	MXByte buff[SECTION_ALIGN];
 	stream.read((char*)buff, 8);
 	if (stream) {
-		if (strcmp((char*)buff, ".greg") != 0) {
+		if (strcmp((char*)buff, ".main") == 0) {
+			stream.read((char*)buff, SECTION_ALIGN - 8);
+			entry = MmixLlvm::Util::adjust64Endianness(ArrayRef<MXByte>(buff, buff + 8));
+			isGreg = false;
+			loc = 0;
+			size = 0;
+		} else if (strcmp((char*)buff, ".greg") != 0) {
 			stream.read((char*)buff, SECTION_ALIGN - 8);
 			MXOcta loBound = MmixLlvm::Util::adjust64Endianness(ArrayRef<MXByte>(buff, buff + 8));
 			MXOcta hiBound = MmixLlvm::Util::adjust64Endianness(ArrayRef<MXByte>(buff + 8, buff + 16));
@@ -141,7 +202,14 @@ void OSImpl::readSection(Engine& e, std::istream& stream, bool& isGreg, MXOcta&
 			std::vector<MXByte> tmp(alignedSectionSize);
 			ArrayRef<MXByte> buff1(tmp);
 			stream.read((char*)&buff1[0], alignedSectionSize);
-			for (size_t i = 0; i < sectionSize; i += 4) {
+			// Whole octabytes where possible; the engine stores them in
+			// whatever byte order its memory uses
+			size_t i = 0;
+			if (loBound % 8 == 0) {
+				for (; i + 8 <= sectionSize; i += 8)
+					e.writeOcta(loBound + i, MmixLlvm::Util::adjust64Endianness(buff1.slice(i, 8)));
+			}
+			for (; i < sectionSize; i += 4) {
 				MXOcta tetraLoc = loBound + i;
 				e.writeTetra(tetraLoc, MmixLlvm::Util::adjust32Endianness(buff1.slice(i, 4))); 
 			}
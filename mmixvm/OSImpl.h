@@ -8,13 +8,27 @@
 
 namespace MmixLlvm {
 	class OSImpl: public MmixLlvm::OS {
-		const std::vector< std::wstring > _argv;
-		static void readSection(Engine& e, std::istream& stream, bool& isGreg, MXOcta& loc, size_t& size);
+		std::vector< std::wstring > _argv;
+		MXOcta _topDataSegAddr;
+		// Where guest stdout and stderr go, null for the console
+		void* _out;
+		std::vector< std::pair<MXOcta, MXOcta> > _textSections;
+		MXOcta _entryPoint;
+		static void readSection(Engine& e, std::istream& stream, bool& isGreg, MXOcta& loc, size_t& size,
+			MXOcta& entry);
 		void makeArgv(Engine& e, MXOcta topDataSegAddr);
-		void doFputs(Engine& e, MXOcta rBB, MXOcta rXX, MXOcta rYY, MXOcta rZZ);
+		// False with the offending address in fault when the string runs
+		// into unmapped memory
+		bool doFputs(Engine& e, MXOcta rBB, MXOcta rXX, MXOcta rYY, MXOcta rZZ, MXOcta& fault);
+		static void reportProtectionFault(Engine& e, MXOcta instr, MXOcta addr);
 	public:
 		OSImpl(const std::vector< std::wstring >& argv);
 		virtual void loadExecutable(Engine& e);
+		// Reuses a loaded executable for another run: args follow the
+		// executable in argv, output goes to the out handle
+		void startJob(Engine& e, const std::vector< std::wstring >& args, void* out);
+		virtual void getTextSections(std::vector< std::pair<MXOcta, MXOcta> >& out);
+		virtual MXOcta getEntryPoint();
 		virtual MXOcta handleTrap(Engine& e, MXOcta instr, MXOcta vector);
 		virtual ~OSImpl();
 	};
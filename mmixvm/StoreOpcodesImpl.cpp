@@ -66,6 +66,7 @@ namespace {
 		builder.SetInsertPoint(success);
 		Value* valToStore = createStoreCast(vctx.getLctx(), builder, xVal, true);
 		emitStoreMem(vctx, builder, theA, adjustEndianness(vctx, builder, valToStore));
+		BasicBlock *stored = builder.GetInsertBlock();
 		builder.CreateBr(epilogue);
 		builder.SetInsertPoint(overflow);
 		Value* overflowAlreadySet = 
@@ -80,7 +81,7 @@ namespace {
 		emitLeaveVerticeViaTrip(vctx, builder, theA, xVal, getArithTripVector(MmixLlvm::V));
 		builder.SetInsertPoint(epilogue);
 		PHINode* ra = builder.CreatePHI(Type::getInt64Ty(vctx.getLctx()), 0);
-		ra->addIncoming(initRaVal, success);
+		ra->addIncoming(initRaVal, stored);
 		ra->addIncoming(overflowRaVal, setOverflowFlag);
 		vctx.assignSpRegister(MmixLlvm::rA, ra);
 		builder.CreateBr(vctx.getOCExit());
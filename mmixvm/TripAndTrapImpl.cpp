@@ -30,6 +30,21 @@ void MmixLlvm::Private::emitTrip(VerticeContext& vctx, IRBuilder<>& builder, MXB
 	emitLeaveVerticeViaTrip(vctx, builder, builder.getInt64(yarg), builder.getInt64(zarg), 0);
 }
 
+// Ends the vertice: the dispatcher has to drop whatever was translated from
+// the X+1 bytes at $Y+$Z before the next instruction is fetched.
+void MmixLlvm::Private::emitSyncid(VerticeContext& vctx, IRBuilder<>& builder, MXByte xarg, MXByte yarg, MXByte zarg, bool immediate)
+{
+	Value* yVal = vctx.getRegister(yarg);
+	Value* zVal = immediate ? builder.getInt64(zarg) : vctx.getRegister(zarg);
+	Value* callParams[] = {
+		builder.CreateLoad(vctx.getModuleVar("ThisRef")),
+		builder.CreateAdd(yVal, zVal),
+		builder.getInt64(xarg)
+	};
+	builder.CreateCall(vctx.getModuleFunction("SyncId"), ArrayRef<Value*>(callParams, callParams + 3));
+	emitLeaveVerticeViaJump(vctx, builder, vctx.getXPtr() + 4);
+}
+
 void MmixLlvm::Private::emitTrap(VerticeContext& vctx, IRBuilder<>& builder, MXByte xarg, MXByte yarg, MXByte zarg)
 {
 	Value* callParams[] = {
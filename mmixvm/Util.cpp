@@ -18,11 +18,18 @@ using MmixLlvm::MXTetra;
 using MmixLlvm::MXOcta;
 
 namespace {
-	int Id = 0;
+	// Per thread: every module is only ever emitted into by one thread, so
+	// names stay unique without the compile workers contending on a counter
+	__declspec(thread) int Id = 0;
 }
 
+// Release builds name nothing: names only cost memory in the context
 Twine MmixLlvm::Util::genUniq(const llvm::Twine& prefix) {
+#ifdef NDEBUG
+	return llvm::Twine();
+#else
 	return llvm::Twine(prefix) + (llvm::Twine(++Id));
+#endif
 }
 
 MXWyde MmixLlvm::Util::adjust16Endianness(llvm::ArrayRef<MXByte>& ref) {
@@ -17,6 +17,8 @@ namespace MmixLlvm {
 
 			virtual llvm::LLVMContext& getLctx() = 0;
 
+			virtual const JitCfg& getCfg() = 0;
+
 			virtual llvm::BasicBlock *getOCEntry() = 0;
 
 			virtual llvm::BasicBlock *getOCExit() = 0;
@@ -39,6 +41,14 @@ namespace MmixLlvm {
 
 			virtual void assignSpRegister(MmixLlvm::SpecialReg reg, llvm::Value* val) = 0;
 
+			virtual llvm::Value *getEdgeLink(MXOcta target) = 0;
+
+			virtual llvm::Value *getInlineCache() = 0;
+
+			virtual llvm::Value *getReturnLink(MXOcta target) = 0;
+
+			virtual bool branchWithinVertice(llvm::IRBuilder<>& builder, MXOcta target) = 0;
+
 			virtual std::vector<MXByte> getDirtyRegisters() = 0;
 
 			virtual std::vector<SpecialReg> getDirtySpRegisters() = 0;
@@ -5,21 +5,338 @@
 #include "MmixHwImpl.h"
 #include "Engine.h"
 #include "OSImpl.h"
+#include "Util.h"
 #include <windows.h>
+#include <errno.h>
+
+namespace {
+	void dumpStats(const MmixLlvm::JitStats& stats) {
+		llvm::errs() << "chained exits:   " << stats.ChainedExits << '\n';
+		llvm::errs() << "unchained exits: " << stats.UnchainedExits << '\n';
+		uint64_t probes = stats.TranslationCacheHits + stats.TranslationCacheMisses;
+		llvm::errs() << "translation cache hits:   " << stats.TranslationCacheHits;
+		if (probes > 0)
+			llvm::errs() << " (" << stats.TranslationCacheHits * 100 / probes << "%)";
+		llvm::errs() << '\n';
+		llvm::errs() << "translation cache misses: " << stats.TranslationCacheMisses << '\n';
+		llvm::errs() << "inline cache hits:   " << stats.InlineCacheHits << '\n';
+		llvm::errs() << "inline cache misses: " << stats.InlineCacheMisses << '\n';
+		llvm::errs() << "return prediction hits:   " << stats.ReturnPredictionHits << '\n';
+		llvm::errs() << "return prediction misses: " << stats.ReturnPredictionMisses << '\n';
+		llvm::errs() << "compiled vertices: " << stats.CompiledVertices << '\n';
+		llvm::errs() << "IR instructions:   " << stats.IrInstructions << '\n';
+		llvm::errs() << "native code bytes: " << stats.NativeCodeBytes << '\n';
+		llvm::errs() << "IR bytes:          " << stats.IrBytes << " emitted, "
+			<< stats.RetainedIrBytes << " retained\n";
+		llvm::errs() << "metadata bytes:    " << stats.MetadataBytes << '\n';
+		if (stats.CompiledVertices > 0) {
+			llvm::errs() << "per vertice:       " << stats.NativeCodeBytes / stats.CompiledVertices
+				<< " code, " << stats.IrBytes / stats.CompiledVertices << " IR emitted, "
+				<< stats.RetainedIrBytes / stats.CompiledVertices << " IR retained, "
+				<< stats.MetadataBytes / stats.CompiledVertices << " metadata\n";
+		}
+		llvm::errs() << "compile time:      " << stats.CompileMicroseconds / 1000 << " ms\n";
+		llvm::errs() << "tier ups:          " << stats.TierUps << '\n';
+		llvm::errs() << "interpreted blocks: " << stats.InterpretedBlocks << '\n';
+		llvm::errs() << "code cache evictions: " << stats.Evictions << '\n';
+		llvm::errs() << "code cache recompiles: " << stats.Recompiles << '\n';
+		llvm::errs() << "code invalidations:    " << stats.Invalidations << '\n';
+		llvm::errs() << "ahead of time vertices:  " << stats.AheadOfTimeVertices << '\n';
+		llvm::errs() << "protection faults:       " << stats.ProtectionFaults << '\n';
+		llvm::errs() << "persistent cache hits:   " << stats.PersistentCacheHits << '\n';
+		llvm::errs() << "persistent cache stores: " << stats.PersistentCacheStores << '\n';
+		llvm::errs() << "speculative compiles: " << stats.SpeculativeCompiles
+			<< " (used " << stats.SpeculativeUsed
+			<< ", wasted " << stats.SpeculativeWasted << ")\n";
+	}
+
+	// LLVM takes file names as UTF-8 on Windows
+	std::string toUtf8(const std::wstring& str) {
+		int len = WideCharToMultiByte(CP_UTF8, 0, str.c_str(), (int)str.size(), NULL, 0, NULL, NULL);
+		std::string retVal(len, '\0');
+		if (len > 0)
+			WideCharToMultiByte(CP_UTF8, 0, str.c_str(), (int)str.size(), &retVal[0], len, NULL, NULL);
+		return retVal;
+	}
+
+	// Value of a numeric -name=<n> option. Anything that is not a plain decimal
+	// number sets bad; values outside [lo, hi] are clamped with a warning.
+	unsigned long parseNumber(const std::wstring& opt, size_t prefix,
+		unsigned long lo, unsigned long hi, bool& bad)
+	{
+		const wchar_t* begin = opt.c_str() + prefix;
+		wchar_t* end;
+		errno = 0;
+		unsigned long value = wcstoul(begin, &end, 10);
+		if (*begin < L'0' || *begin > L'9' || *end != 0 || errno == ERANGE) {
+			llvm::errs() << "invalid number in option " << toUtf8(opt) << '\n';
+			bad = true;
+			return lo;
+		}
+		if (value < lo || value > hi) {
+			value = value < lo ? lo : hi;
+			llvm::errs() << "option " << toUtf8(opt.substr(0, prefix)) << " clamped to " << (uint64_t)value << '\n';
+		}
+		return value;
+	}
+
+	std::wstring getExecutableDir() {
+		wchar_t path[MAX_PATH];
+		DWORD len = GetModuleFileNameW(NULL, path, MAX_PATH);
+		std::wstring dir(path, len);
+		dir.erase(dir.find_last_of(L"\\/") + 1);
+		return dir;
+	}
+
+	// The helper library is built next to the executable. Without it the
+	// helpers are only called out of line, so a missing one is not an error
+	// unless named with -runtime=.
+	std::string getRuntimeBitcodePath() {
+		std::wstring path = getExecutableDir() + L"MmixRuntime.bc";
+		return GetFileAttributesW(path.c_str()) != INVALID_FILE_ATTRIBUTES ? toUtf8(path) : std::string();
+	}
+
+	// Where -aot keeps its code when no -cachedir is given
+	std::string getDefaultCacheDir() {
+		return toUtf8(getExecutableDir() + L"cache");
+	}
+
+	// A request is the UTF-8 guest arguments, each NUL terminated, closed by
+	// an empty one.
+	bool readRequest(HANDLE pipe, std::vector< std::wstring >& args) {
+		std::vector<MmixLlvm::MXByte> arg;
+		for (;;) {
+			char c;
+			DWORD bytesRead;
+			if (!ReadFile(pipe, &c, 1, &bytesRead, NULL) || bytesRead == 0)
+				return false;
+			if (c != 0) {
+				arg.push_back((MmixLlvm::MXByte)c);
+			} else if (arg.empty()) {
+				return true;
+			} else {
+				args.push_back(MmixLlvm::Util::fromUTF8(arg));
+				arg.clear();
+			}
+		}
+	}
+
+	// State the console control handler shuts the server down through
+	MmixLlvm::MmixHwImpl* servedHw;
+
+	std::wstring servedPath;
+
+	volatile bool stopServing;
+
+	VOID CALLBACK stopGuest(PVOID hw, BOOLEAN) {
+		((MmixLlvm::MmixHwImpl*)hw)->requestStop();
+	}
+
+	// Stops the job in progress and wakes up a server waiting for a client by
+	// connecting to it.
+	BOOL WINAPI onConsoleCtrl(DWORD) {
+		stopServing = true;
+		servedHw->requestStop();
+		HANDLE pipe = CreateFileW(servedPath.c_str(), GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING, 0, NULL);
+		if (pipe != INVALID_HANDLE_VALUE)
+			CloseHandle(pipe);
+		return TRUE;
+	}
+
+	// Serves one client at a time on \\.\pipe\<name> until Ctrl+C. Every job
+	// starts from the state right after loading, with its own statistics, and
+	// the guest output goes back through the pipe until the guest halts or
+	// runs out of its timeout milliseconds (0 for none), and the pipe is
+	// closed. Returns the exit code.
+	int serve(MmixLlvm::MmixHwImpl& hw, MmixLlvm::OSImpl& os, const std::wstring& name, unsigned long timeout,
+		bool showStats)
+	{
+		servedHw = &hw;
+		servedPath = L"\\\\.\\pipe\\" + name;
+		stopServing = false;
+		MmixLlvm::MXOcta entry = hw.load();
+		hw.takeSnapshot();
+		SetConsoleCtrlHandler(onConsoleCtrl, TRUE);
+		int retVal = 0;
+		while (!stopServing) {
+			HANDLE pipe = CreateNamedPipeW(servedPath.c_str(), PIPE_ACCESS_DUPLEX, PIPE_TYPE_BYTE | PIPE_WAIT,
+				1, 4096, 4096, 0, NULL);
+			if (pipe == INVALID_HANDLE_VALUE) {
+				llvm::errs() << "cannot create pipe, error " << (unsigned)GetLastError() << '\n';
+				retVal = 1;
+				break;
+			}
+			std::vector< std::wstring > args;
+			if ((ConnectNamedPipe(pipe, NULL) || GetLastError() == ERROR_PIPE_CONNECTED)
+				&& !stopServing && readRequest(pipe, args))
+			{
+				hw.restoreSnapshot();
+				hw.resetStats();
+				os.startJob(hw, args, pipe);
+				HANDLE timer = NULL;
+				if (timeout > 0)
+					CreateTimerQueueTimer(&timer, NULL, stopGuest, &hw, timeout, 0, WT_EXECUTEONLYONCE);
+				hw.execute(entry);
+				// Waits for a callback in flight, which would otherwise stop the
+				// next job
+				if (timer != NULL)
+					DeleteTimerQueueTimer(NULL, timer, INVALID_HANDLE_VALUE);
+				FlushFileBuffers(pipe);
+				if (hw.wasStopped() && !stopServing)
+					llvm::errs() << "job stopped after " << (uint64_t)timeout << " ms\n";
+				if (showStats)
+					dumpStats(hw.getStats());
+			}
+			DisconnectNamedPipe(pipe);
+			CloseHandle(pipe);
+		}
+		SetConsoleCtrlHandler(onConsoleCtrl, FALSE);
+		return retVal;
+	}
+};
 
 int _tmain(int argc, _TCHAR* argv[])
 {
-	if (argc >= 2) {
+	MmixLlvm::JitCfg jitCfg;
+	jitCfg.EnableChaining = true;
+	jitCfg.TranslationCacheBits = 12;
+	jitCfg.InlineCacheSize = 2;
+	jitCfg.EnableReturnPrediction = true;
+	jitCfg.EnableSuperblocks = true;
+	jitCfg.SuperblockMaxInstrs = 256;
+	jitCfg.SuperblockMaxJumps = 8;
+	jitCfg.EnableLoopRegisters = true;
+	jitCfg.OptLevel = 2;
+	jitCfg.TierUpThreshold = 1000;
+	jitCfg.InterpThreshold = 50;
+	jitCfg.CompileThreads = 2;
+	jitCfg.EnableSpeculation = false;
+	jitCfg.BatchBudget = 16;
+	jitCfg.CodeCacheBytes = 0;
+	jitCfg.EnableAot = false;
+	jitCfg.AotBudget = 4096;
+	jitCfg.NativeByteOrder = false;
+	jitCfg.EnablePreemption = false;
+	jitCfg.EnableExitCounters = false;
+	jitCfg.RuntimeBitcode = getRuntimeBitcodePath();
+	bool showStats = false;
+	bool badOption = false;
+	std::wstring pipeName;
+	unsigned long timeout = 0;
+	// Only reserved; pages are committed as the guest touches them. Four
+	// segments of the largest size still fit the address space.
+	size_t maxSegmentSize = sizeof(void*) == 8 ? (size_t)1 << 32 : (size_t)1 << 26;
+	size_t segmentSize = maxSegmentSize;
+	int i = 1;
+	for (; i < argc && argv[i][0] == _T('-'); i++) {
+		std::wstring opt(argv[i]);
+		if (opt == L"-nochain")
+			jitCfg.EnableChaining = false;
+		else if (opt == L"-noretpred")
+			jitCfg.EnableReturnPrediction = false;
+		else if (opt == L"-nosuperblock")
+			jitCfg.EnableSuperblocks = false;
+		else if (opt.compare(0, 7, L"-sbmax=") == 0)
+			jitCfg.SuperblockMaxInstrs = parseNumber(opt, 7, 1, 4096, badOption);
+		else if (opt.compare(0, 9, L"-sbjumps=") == 0)
+			jitCfg.SuperblockMaxJumps = parseNumber(opt, 9, 0, 256, badOption);
+		else if (opt == L"-noloopregs")
+			jitCfg.EnableLoopRegisters = false;
+		else if (opt == L"-O0" || opt == L"-O1" || opt == L"-O2")
+			jitCfg.OptLevel = opt[2] - L'0';
+		else if (opt.compare(0, 8, L"-tierup=") == 0)
+			jitCfg.TierUpThreshold = parseNumber(opt, 8, 0, ULONG_MAX, badOption);
+		else if (opt.compare(0, 8, L"-interp=") == 0)
+			jitCfg.InterpThreshold = parseNumber(opt, 8, 0, ULONG_MAX, badOption);
+		else if (opt.compare(0, 9, L"-threads=") == 0)
+			jitCfg.CompileThreads = parseNumber(opt, 9, 0, 64, badOption);
+		else if (opt == L"-speculate")
+			jitCfg.EnableSpeculation = true;
+		else if (opt.compare(0, 7, L"-batch=") == 0)
+			jitCfg.BatchBudget = parseNumber(opt, 7, 1, 1024, badOption);
+		else if (opt.compare(0, 11, L"-codecache=") == 0)
+			jitCfg.CodeCacheBytes = (uint64_t)parseNumber(opt, 11, 0, ULONG_MAX, badOption) * 1024;
+		else if (opt.compare(0, 10, L"-cachedir=") == 0)
+			jitCfg.CacheDir = toUtf8(opt.substr(10));
+		else if (opt == L"-aot")
+			jitCfg.EnableAot = true;
+		else if (opt.compare(0, 5, L"-aot=") == 0) {
+			jitCfg.EnableAot = true;
+			jitCfg.AotBudget = parseNumber(opt, 5, 1, ULONG_MAX, badOption);
+		}
+		else if (opt == L"-hostorder")
+			jitCfg.NativeByteOrder = true;
+		else if (opt.compare(0, 9, L"-runtime=") == 0)
+			jitCfg.RuntimeBitcode = toUtf8(opt.substr(9));
+		else if (opt == L"-noruntime")
+			jitCfg.RuntimeBitcode.clear();
+		else if (opt.compare(0, 7, L"-serve=") == 0)
+			pipeName = opt.substr(7);
+		else if (opt.compare(0, 9, L"-timeout=") == 0)
+			timeout = parseNumber(opt, 9, 0, ULONG_MAX, badOption);
+		else if (opt == L"-stats")
+			showStats = true;
+		else if (opt.compare(0, 9, L"-segsize=") == 0) {
+			// In megabytes, a power of two
+			bool bad = false;
+			size_t megabytes = parseNumber(opt, 9, 0, ULONG_MAX, bad);
+			if (bad) {
+				badOption = true;
+			} else if (megabytes == 0 || (megabytes & (megabytes - 1)) != 0 || megabytes > (maxSegmentSize >> 20)) {
+				llvm::errs() << "-segsize must be a power of two up to " << (uint64_t)(maxSegmentSize >> 20) << '\n';
+				badOption = true;
+			} else {
+				segmentSize = megabytes << 20;
+			}
+		}
+		else if (opt.compare(0, 8, L"-tcbits=") == 0)
+			jitCfg.TranslationCacheBits = parseNumber(opt, 8, 1, 24, badOption);
+		else if (opt.compare(0, 8, L"-icsize=") == 0)
+			jitCfg.InlineCacheSize = parseNumber(opt, 8, 0, 16, badOption);
+		else {
+			llvm::errs() << "unknown option " << toUtf8(opt) << '\n';
+			badOption = true;
+		}
+	}
+	if (badOption)
+		return 1;
+	if (jitCfg.EnableSpeculation && (jitCfg.CompileThreads == 0 || !jitCfg.EnableChaining)) {
+		llvm::errs() << "-speculate needs compile threads and chaining, ignored\n";
+		jitCfg.EnableSpeculation = false;
+	}
+	// Only a served job can be stopped before it halts
+	jitCfg.EnablePreemption = !pipeName.empty();
+	jitCfg.EnableExitCounters = showStats;
+	// Code compiled ahead of time only pays off in later runs
+	if (jitCfg.EnableAot && jitCfg.CacheDir.empty())
+		jitCfg.CacheDir = getDefaultCacheDir();
+	if (argc - i >= 1) {
 		llvm::InitializeNativeTarget();
 		MmixLlvm::HardwareCfg cfg;
-		enum { _16K = 16 * 1024 };
-		cfg.TextSize = cfg.HeapSize = cfg.PoolSize = cfg.StackSize = _16K;
+		cfg.TextSize = cfg.HeapSize = cfg.PoolSize = cfg.StackSize = segmentSize;
 		std::vector< std::wstring > argv0;
-		for (int i = 1; i < argc; i++)
+		for (; i < argc; i++)
 			argv0.push_back(std::wstring(argv[i]));
-		boost::shared_ptr<MmixLlvm::Engine> theHw(MmixLlvm::MmixHwImpl::create(cfg,
-			boost::shared_ptr<MmixLlvm::OS>(new MmixLlvm::OSImpl(argv0))));
-		theHw->run(0x100);
+		boost::shared_ptr<MmixLlvm::OSImpl> theOS(new MmixLlvm::OSImpl(argv0));
+		boost::shared_ptr<MmixLlvm::MmixHwImpl> theHw(MmixLlvm::MmixHwImpl::create(cfg, jitCfg, theOS));
+		if (!pipeName.empty()) {
+			int retVal = serve(*theHw, *theOS, pipeName, timeout, showStats);
+			theHw.reset();
+			llvm::llvm_shutdown();
+			return retVal;
+		}
+		LARGE_INTEGER freq, start, stop;
+		QueryPerformanceFrequency(&freq);
+		QueryPerformanceCounter(&start);
+		theHw->execute(theHw->load());
+		QueryPerformanceCounter(&stop);
+		if (showStats) {
+			dumpStats(theHw->getStats());
+			llvm::errs() << "run time: " << (stop.QuadPart - start.QuadPart) * 1000 / freq.QuadPart << " ms\n";
+		}
+		// Joins the compile workers and destroys the engines, which must not
+		// outlive LLVM's static state
+		theHw.reset();
 		llvm::llvm_shutdown();
 	}
 	return 0;
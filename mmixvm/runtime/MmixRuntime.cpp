@@ -0,0 +1,64 @@
+// MmixRuntime.cpp : Helpers called by generated code, compiled to bitcode
+// (MmixRuntime.bc) and linked into optimized job modules so that the pass
+// pipeline can inline and fold them. The same file is compiled into the VM,
+// where MmixHwImpl::postInit maps the names to these definitions for the
+// calls left out of line.
+//
+// Built by clang as well, so nothing here may depend on the rest of the
+// project; the signatures must match the declarations in
+// MmixHwImpl::declareRuntime. The bitcode is only readable by the LLVM
+// release of the clang that wrote it, which must be the one the VM links
+// against.
+
+#include "MmixRuntime.h"
+
+extern "C" {
+	// Only called with hidivident < divisor, so the quotient fits an octabyte
+	void DivuImpl(uint64_t hidivident, uint64_t lodivident, uint64_t divisor,
+		uint64_t* quotient, uint64_t* remainder)
+	{
+		uint64_t rem = hidivident, quot = lodivident;
+		for (int i = 0; i < 64; i++) {
+			uint64_t carry = rem >> 63;
+			rem = (rem << 1) | (quot >> 63);
+			quot <<= 1;
+			if (carry != 0 || rem >= divisor) {
+				rem -= divisor;
+				quot |= 1;
+			}
+		}
+		*quotient = quot;
+		*remainder = rem;
+	}
+
+	// Eight rounds, one per bit j of the Z bytes: the bytes of z with bit j
+	// set take a copy of y byte j. Each round widens the selecting bits to
+	// byte masks and y byte j to all eight bytes by multiplication. Branch
+	// free, so they unroll into straight line code once inlined.
+	uint64_t MorImpl(uint64_t y, uint64_t z) {
+		uint64_t retVal = 0;
+		for (int j = 0; j < 8; j++) {
+			uint64_t mask = ((z >> j) & 0x0101010101010101ULL) * 0xFF;
+			retVal |= mask & (((y >> (j << 3)) & 0xFF) * 0x0101010101010101ULL);
+		}
+		return retVal;
+	}
+
+	uint64_t MxorImpl(uint64_t y, uint64_t z) {
+		uint64_t retVal = 0;
+		for (int j = 0; j < 8; j++) {
+			uint64_t mask = ((z >> j) & 0x0101010101010101ULL) * 0xFF;
+			retVal ^= mask & (((y >> (j << 3)) & 0xFF) * 0x0101010101010101ULL);
+		}
+		return retVal;
+	}
+
+	// Written with shifts rather than through a byte pointer so that it
+	// folds into a bswap
+	uint64_t Adjust64EndiannessImpl(uint64_t arg) {
+		return (arg << 56) | ((arg & 0xFF00) << 40)
+			| ((arg & 0xFF0000) << 24) | ((arg & 0xFF000000) << 8)
+			| ((arg >> 8) & 0xFF000000) | ((arg >> 24) & 0xFF0000)
+			| ((arg >> 40) & 0xFF00) | (arg >> 56);
+	}
+}
@@ -0,0 +1,17 @@
+// MmixRuntime.h : The helpers of MmixRuntime.cpp, for the host build. Generated
+// code calls them by these names.
+
+#pragma once
+
+#include <stdint.h>
+
+extern "C" {
+	void DivuImpl(uint64_t hidivident, uint64_t lodivident, uint64_t divisor,
+		uint64_t* quotient, uint64_t* remainder);
+
+	uint64_t MorImpl(uint64_t y, uint64_t z);
+
+	uint64_t MxorImpl(uint64_t y, uint64_t z);
+
+	uint64_t Adjust64EndiannessImpl(uint64_t arg);
+}
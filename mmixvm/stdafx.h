@@ -9,7 +9,6 @@
 
 #include <tchar.h>
 #include <stdint.h>
-#include <gmpxx.h>
 #include <limits.h>
 #include <vector>
 #include <stack>
@@ -18,9 +17,11 @@
 #include <iterator>
 #include <algorithm>
 #include <boost/tuple/tuple.hpp>
+#include <boost/bind.hpp>
 #include <boost/scoped_ptr.hpp>
 #include <boost/shared_ptr.hpp>
 #include <boost/unordered_map.hpp>
+#include <boost/unordered_set.hpp>
 
 #include <llvm/IR/Constants.h>
 #include <llvm/IR/DerivedTypes.h>
@@ -33,8 +34,26 @@
 #include <llvm/ExecutionEngine/JIT.h>
 #include <llvm/ExecutionEngine/Interpreter.h>
 #include <llvm/ExecutionEngine/GenericValue.h>
+#include <llvm/ExecutionEngine/JITEventListener.h>
+#include <llvm/PassManager.h>
+#include <llvm/Linker.h>
+#include <llvm/IR/DataLayout.h>
+#include <llvm/Bitcode/ReaderWriter.h>
+#include <llvm/Config/llvm-config.h>
+#include <llvm/ADT/OwningPtr.h>
+#include <llvm/Analysis/Passes.h>
+#include <llvm/Transforms/Scalar.h>
+#include <llvm/Transforms/IPO.h>
+#include <llvm/Transforms/Utils/Cloning.h>
+#include <llvm/ADT/StringExtras.h>
+#include <llvm/ADT/Hashing.h>
+#include <llvm/Support/Timer.h>
 #include <llvm/Support/TargetSelect.h>
 #include <llvm/Support/ManagedStatic.h>
+#include <llvm/Support/Threading.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/Path.h>
 #include <llvm/Support/raw_ostream.h>
 
 // TODO: reference additional headers your program requires here